@@ -0,0 +1,53 @@
+// Port change notifications from reaper_automidireset, for other REAPER
+// extensions. Copy this header into your project; nothing needs linking.
+//
+//   AutoMIDIReset_Subscribe_t subscribe = (AutoMIDIReset_Subscribe_t)plugin_getapi(AUTOMIDIRESET_SUBSCRIBE);
+//   if (subscribe) subscribe(onPortChanges, myData);
+//
+// The callback runs on REAPER's main thread after the port table changes,
+// with the ports that were added, removed or re-initialized since the last
+// call. Names are only valid during the call. Unsubscribe before unloading.
+//
+// Later versions only append fields to AutoMIDIReset_PortChange, and fill
+// in its size: step through the changes with AUTOMIDIRESET_PORT_CHANGE()
+// rather than indexing, and check size before reading a field added after
+// version 1.
+
+#ifndef AUTOMIDIRESET_API_H
+#define AUTOMIDIRESET_API_H
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include <stddef.h>
+
+#define AUTOMIDIRESET_API_VERSION 1
+
+#define AUTOMIDIRESET_SUBSCRIBE "AutoMIDIReset_Subscribe"
+#define AUTOMIDIRESET_UNSUBSCRIBE "AutoMIDIReset_Unsubscribe"
+
+enum {
+  AutoMIDIReset_PortAdded = 0,
+  AutoMIDIReset_PortRemoved = 1,
+  AutoMIDIReset_PortReinited = 2
+};
+
+typedef struct AutoMIDIReset_PortChange {
+  int size;   // sizeof(AutoMIDIReset_PortChange) in the sending version
+  int change; // AutoMIDIReset_PortAdded, _PortRemoved or _PortReinited
+  int output; // 0 input, 1 output
+  int index;
+  const char *name;
+} AutoMIDIReset_PortChange;
+
+#define AUTOMIDIRESET_PORT_CHANGE(changes, i) \
+  ((const AutoMIDIReset_PortChange *)((const char *)(changes) + (size_t)(i) * (changes)->size))
+
+typedef void (*AutoMIDIReset_Callback)(const AutoMIDIReset_PortChange *changes, int numChanges, void *userData);
+
+// false if the callback was already subscribed with this userData (or NULL)
+typedef bool (*AutoMIDIReset_Subscribe_t)(AutoMIDIReset_Callback callback, void *userData);
+// false if it wasn't subscribed
+typedef bool (*AutoMIDIReset_Unsubscribe_t)(AutoMIDIReset_Callback callback, void *userData);
+
+#endif
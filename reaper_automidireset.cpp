@@ -17,23 +17,32 @@
 // =======
 //
 // (Use the VS Command Prompt matching your REAPER architecture, eg. x64 to use the 64-bit compiler)
-// cl /nologo /O2 /Z7 /Zo /DUNICODE /I..\..\WDL\WDL /I..\..\sdk reaper_automidireset.cpp user32.lib /link /DEBUG /OPT:REF /PDBALTPATH:%_PDB% /DLL /OUT:reaper_automidireset.dll
+// cl /nologo /O2 /Z7 /Zo /DUNICODE /DNOMINMAX /I..\..\WDL\WDL /I..\..\sdk reaper_automidireset.cpp user32.lib winmm.lib /link /DEBUG /OPT:REF /PDBALTPATH:%_PDB% /DLL /OUT:reaper_automidireset.dll
 //
 // MinGW64 appears to work, as well:
-//  c++ -fPIC -O2 -std=c++14 -DUNICODE -I../../WDL/WDL -I../../sdk -shared reaper_automidireset.cpp -o reaper_automidireset.dll
+//  c++ -fPIC -O2 -std=c++14 -DUNICODE -DNOMINMAX -I../../WDL/WDL -I../../sdk -shared reaper_automidireset.cpp -lwinmm -o reaper_automidireset.dll
 //
 // Linux (not supported)
 // =====
 //
 // c++ -fPIC -O2 -std=c++14 -IWDL/WDL -shared main.cpp -o reaper_barebone.so
 
+#if defined(_WIN32) && !defined(NOMINMAX)
+#define NOMINMAX // the SDK includes windows.h, whose min/max macros break std::min/std::max
+#endif
 #define REAPERAPI_IMPLEMENT
 #include "reaper_plugin_functions.h"
+#include "automidireset_api.h"
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
 
 #define VERSION_STRING "1.3"
 
 static int commandId = 0;
+static int traceCommandId = 0;
+static int benchCommandId = 0;
 
 #ifdef WIN32
 
@@ -48,28 +57,140 @@ static const GUID GUID_AUDIO_DEVIFACE = {0x6994AD04L, 0x93EF, 0x11D0, {0xA3, 0xC
 static WCHAR WND_CLASS_MIDI_NAME[] = L"midiDummyWindow";
 #define kMidiDeviceType ((void *)1)
 void CALLBACK ScheduleMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime);
+void CALLBACK DeferredMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime);
+void CALLBACK VerifyMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime);
 bool RegisterDeviceInterfaceToHwnd(HWND hwnd, HDEVNOTIFY *hDeviceNotify);
 DWORD WINAPI window_thread(LPVOID params);
 HWND hDummyWindow;
 #define WM_MIDI_REINIT (WM_USER + 1)
 #define WM_MIDI_INIT (WM_USER + 2)
+#define WM_MIDI_RECONCILE (WM_USER + 3)
+#define WM_MIDI_VERIFY (WM_USER + 4)
+#define WM_MIDI_BENCHMARK (WM_USER + 5) // result handed back through g_benchOutput
 
 #elif __linux__
 
 #include <algorithm>
 #include <thread>
 #include <chrono>
+#include <unordered_map>
+#include <string>
 #include <libusb.h>
+#include <time.h>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <cstddef>
+#include <dlfcn.h>
+#include <sys/inotify.h>
+#include <climits>
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
 
 using std::thread;
 
+// Our own context, so that another libusb user in REAPER's process (a
+// control surface driver, say) doesn't share our event handling: with the
+// default context, its handle_events calls and ours would take each
+// other's hotplug events.
+static libusb_context *g_usbCtx = NULL;
+
+// libusb isn't linked: the service thread loads it once REAPER is up (see
+// usbLoad()), so the extension loads without it and doesn't add its startup
+// to REAPER's. Without libusb, the ALSA device nodes are watched instead.
+#define LIBUSB_FUNCTIONS(X) \
+  X(init) X(exit) X(has_capability) X(hotplug_register_callback) X(handle_events_timeout) \
+  X(get_device_list) X(free_device_list) X(get_device_descriptor) X(get_config_descriptor) \
+  X(free_config_descriptor) X(get_bus_number) X(get_device_address) X(get_port_numbers)
+
+static struct {
+  void *handle;
+#define LIBUSB_POINTER(name) decltype(&::libusb_##name) name;
+  LIBUSB_FUNCTIONS(LIBUSB_POINTER)
+#undef LIBUSB_POINTER
+} g_libusb;
+
+static std::atomic<double> g_usbLoadMs(-1.); // dlopen + dlsym on the service thread, < 0 if not loaded; relaxed
+static bool usbLoad();
+static void usbUnload();
+
+// fallback monitor: inotify on /dev/snd, see alsaStart()
+static int g_alsaFd = -1;
+static std::unordered_map<int, std::string> g_alsaCards; // card number -> identity, for nodes already gone
+static bool alsaStart();
+static void alsaStop();
+static void alsaReceive();
+
+static std::atomic<const char *> g_monitorStatus; // what the service thread watches, for showInfo(); string literals, so relaxed
 static libusb_hotplug_callback_handle g_hp[2];
 static thread g_usbServiceThread;
-static bool g_usbInited = false;
+// Set while the service thread should run. Relaxed: it carries no data, only
+// asks the loop to stop; thread creation and join() order everything else.
+static std::atomic<bool> g_usbInited(false);
 typedef void (*timer_function)();
 
-static bool is_midi_device(libusb_device *dev, struct libusb_device_descriptor *desc);
+// USB-MIDI 1.0 class-specific descriptor types (usbmidi10.pdf, appendix A)
+#define USB_DT_CS_INTERFACE 0x24
+#define USB_DT_CS_ENDPOINT 0x25
+#define USB_MS_HEADER 0x01
+#define USB_MS_MIDI_IN_JACK 0x02
+#define USB_MS_MIDI_OUT_JACK 0x03
+#define USB_MS_GENERAL 0x01
+#define USB_MS_JACK_EMBEDDED 0x01
+
+// number of host-side ports a MIDIStreaming device is expected to create
+struct midi_port_counts {
+  int inputs;
+  int outputs;
+};
+
+// MIDI devices seen on the bus, keyed by usb_device_key(). Filled on arrival so
+// that DEVICE_LEFT never has to read descriptors from a device that's gone.
+// Only touched on the service thread, which registers the hotplug callbacks
+// (enumerating what is present), handles their events and runs the sweep,
+// so it needs no lock. Devices our rules exclude are kept as well, for the
+// broker's subscribers.
+struct usb_midi_device {
+  uint32_t session;  // arrival sequence number, distinguishes reused addresses
+  uint16_t vid;
+  uint16_t pid;
+  midi_port_counts counts;
+  std::string path;     // usb_device_path()
+  std::string identity; // usbIdentity(), for dedupReport()
+};
+static std::unordered_map<uint16_t, usb_midi_device> g_usbDevices;
+static uint32_t g_usbSession = 0;
+static bool g_usbEnumerating = false; // initial LIBUSB_HOTPLUG_ENUMERATE pass, don't reinit
+static bool g_usbRunning = false;     // usbStart() succeeded; a broker subscriber leaves libusb alone
+
+static inline uint16_t usb_device_key(libusb_device *dev)
+{
+  return (uint16_t)((g_libusb.get_bus_number(dev) << 8) | g_libusb.get_device_address(dev));
+}
+
+// sysfs-style physical location, eg. "3-1.4"
+static void usb_device_path(libusb_device *dev, char *buf, int bufSize)
+{
+  uint8_t ports[8];
+  int numPorts = g_libusb.get_port_numbers(dev, ports, 8);
+  int len = snprintf(buf, bufSize, "%d", g_libusb.get_bus_number(dev));
+  for (int i = 0; i < numPorts && len < bufSize; ++i) {
+    len += snprintf(buf + len, bufSize - len, "%c%d", i ? '.' : '-', ports[i]);
+  }
+}
+
+static std::string usbIdentity(const char *path, uint16_t vid, uint16_t pid);
+static bool is_midi_device(libusb_device *dev, struct libusb_device_descriptor *desc, midi_port_counts *counts);
+static bool usb_device_left(uint16_t key, int source);
+static bool usb_sweep();
+static bool parse_ms_interface(const struct libusb_interface_descriptor *altsetting, midi_port_counts *counts);
 static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data);
+static bool usbStart();
+static void usbStop();
+static void serviceThread();
+static void configureServiceThread();
 
 #else // __APPLE__
 
@@ -82,10 +203,46 @@ static MIDIClientRef g_MIDIClient = 0;
 #ifndef WIN32 // __linux__ or __APPLE__
 
 #include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+// Threads: REAPER's thread runs the timer and owns the debounce, reconcile
+// and verify state. On Linux the service thread runs libusb, the broker and
+// the sweep, and owns the device registry; on macOS CoreMIDI notifies on
+// REAPER's run loop. The one handoff is a device event: the service thread
+// adds what it learned to the g_expected* hints (relaxed), then raises
+// g_eventReceived with release; the timer takes it with an acquire exchange,
+// so the hints written before it are visible. See noteDeviceEvent().
 using std::atomic;
 static atomic<bool> g_eventReceived;
-static atomic<bool> g_listsInited;
+static bool g_listsInited;             // REAPER's thread only
+static atomic<int> g_expectedInputs;  // ports announced by arrivals in the current debounce
+static atomic<int> g_expectedOutputs;
+static atomic<bool> g_expectedUnknown; // an event arrived whose port count can't be predicted
+
+static inline void noteDeviceEvent()
+{
+  g_eventReceived.store(true, std::memory_order_release);
+}
+
+// at load, before the service thread or CoreMIDI can notify
+static inline void resetDeviceEvents()
+{
+  g_eventReceived.store(false, std::memory_order_relaxed);
+  g_expectedInputs.store(0, std::memory_order_relaxed);
+  g_expectedOutputs.store(0, std::memory_order_relaxed);
+  g_expectedUnknown.store(false, std::memory_order_relaxed);
+}
+
+// timer only; true if an event arrived since the last call
+static inline bool takeDeviceEvent()
+{
+  return g_eventReceived.exchange(false, std::memory_order_acquire);
+}
 
 using namespace std::literals;
 static void reaperTimer();
@@ -93,21 +250,785 @@ static void reaperTimer();
 #endif
 
 #include <vector>
+#include <string>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+// Like all the reconcile state, owned by REAPER's thread, or by the window
+// thread on Windows (which the actions only read through snapshots, see
+// g_status, or post messages to).
 std::vector<bool> inputsList;
 std::vector<bool> outputsList;
+static std::vector<std::string> g_portNames[2]; // input, output; as of the last scan
+static std::vector<uint32_t> g_portReinits[2];   // midi_reinit or midi_init reopened the port, by index
+
+// The port table, published for readers on any thread as immutable
+// snapshots (see publishPortTable() and PortTableReader). The owner of
+// inputsList/outputsList fills a slot no reader has pinned and makes it
+// current; a reader pins the current slot with its reader count, and only
+// retries if a new snapshot was published in between. Neither side ever
+// blocks the other, but that's lock-free, not wait-free: a reader retries
+// for as long as publishes keep landing between its load and its pin (in
+// practice a publish costs far more than that window), and a publish is
+// skipped, and retried later, while readers pin every spare slot. Readers
+// should copy what they need and let go. tests/bench_port_table measures
+// reader throughput under continuous publishes.
+#define PORT_TABLE_SLOTS 4
+
+struct PortState {
+  std::string name;
+  bool attached;
+  uint32_t reinits; // times a reinit reopened it, see g_portReinits
+};
+
+struct PortSnapshot {
+  uint64_t generation; // bumped whenever a port appears, goes, (de)attaches or is reopened
+  std::vector<PortState> ports[2]; // input, output
+  std::chrono::steady_clock::time_point published;
+};
+
+static struct {
+  PortSnapshot slots[PORT_TABLE_SLOTS];
+  std::atomic<int> readers[PORT_TABLE_SLOTS];
+  std::atomic<int> current;
+  uint64_t generation; // writer only
+  bool dirty;          // a publish found every spare slot pinned, retry
+  int skipped;
+} g_portTable;
+
+static void publishPortTable();
+
+struct PortTableReader {
+  int slot;
+
+  PortTableReader()
+  {
+    for (;;) {
+      slot = g_portTable.current.load();
+      g_portTable.readers[slot].fetch_add(1);
+      if (g_portTable.current.load() == slot) return; // pinned before the writer could pick it
+      g_portTable.readers[slot].fetch_sub(1, std::memory_order_release);
+    }
+  }
+  ~PortTableReader() { g_portTable.readers[slot].fetch_sub(1, std::memory_order_release); }
+  const PortSnapshot &snapshot() const { return g_portTable.slots[slot]; }
+};
+
+// The statistics and metrics of the owner of the reconcile state, published
+// the same way for the actions and scripts. On Windows the owner is the window thread, which can
+// be busy in midi_reinit for seconds: waiting on it with SendMessage would
+// stall REAPER, and deadlock if it ever waited on REAPER in turn. See
+// publishStatus().
+#define STATUS_SLOTS 3
+#define STATUS_INTERVAL_MS 1000
+
+typedef std::vector<std::pair<const char *, double>> MetricValues;
+
+struct StatusSnapshot {
+  std::string stats;    // appendStats()
+  MetricValues metrics; // collectMetrics(), for AutoMIDIReset_GetMetric()
+};
+
+static struct {
+  StatusSnapshot slots[STATUS_SLOTS];
+  std::atomic<int> readers[STATUS_SLOTS];
+  std::atomic<int> current;
+  std::chrono::steady_clock::time_point lastPublish; // writer only
+} g_status;
+
+static void publishStatus();
+static void maybePublishStatus();
+static void collectMetrics(MetricValues &metrics);
+
+struct StatusReader {
+  int slot;
+
+  StatusReader()
+  {
+    for (;;) {
+      slot = g_status.current.load();
+      g_status.readers[slot].fetch_add(1);
+      if (g_status.current.load() == slot) return;
+      g_status.readers[slot].fetch_sub(1, std::memory_order_release);
+    }
+  }
+  ~StatusReader() { g_status.readers[slot].fetch_sub(1, std::memory_order_release); }
+  const StatusSnapshot &snapshot() const { return g_status.slots[slot]; }
+};
+
+// Push notifications for other extensions, so that they don't each poll the
+// ports to re-bind their control surfaces. C only, so there's no APIdef_;
+// the types and names are in automidireset_api.h, for the subscribers.
+
+#define NOTIFY_LATENCY_SAMPLES 64
+
+// All of this belongs to REAPER's main thread.
+static std::vector<std::pair<AutoMIDIReset_Callback, void *>> g_subscribers;
+static PortSnapshot g_delivered; // what the subscribers have been told about
+static struct {
+  int count;
+  std::vector<double> latencyMs; // publish to delivery, the last NOTIFY_LATENCY_SAMPLES
+} g_notifyStats;
+
+static inline double elapsedMs(std::chrono::steady_clock::time_point since)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Device include/exclude rules, read once from <resource path>/automidireset-rules.txt:
+//
+//   # comment
+//   exclude usb 1235:8210     (VID:PID in hex, PID may be *)
+//   include usb 0582:*
+//   exclude path 3-1.4        (bus-port.port..., as in /sys/bus/usb/devices)
+//   exclude name *Focusrite*  (REAPER port name, * and ? wildcards)
+//   priority clock *MIDISport* (re-init these ports first: clock, surface or high)
+//
+// If there are include rules of a kind, only matching devices are handled;
+// excludes always win. usb rules apply on Linux and Windows, path rules on
+// Linux only. Read-only once loaded, so any thread may query it.
+struct NameGlob {
+  std::vector<std::string> segments; // the pattern split at '*'
+  bool anchoredStart;
+  bool anchoredEnd;
+};
+
+struct DeviceRules {
+  std::unordered_set<uint32_t> includeUsb, excludeUsb; // (vid << 16) | pid, pid 0xFFFF == any
+  std::unordered_set<std::string> includePaths, excludePaths;
+  std::vector<NameGlob> includeNames, excludeNames;
+  std::vector<std::pair<NameGlob, int>> priorityNames; // glob, PortPriority
+};
+
+// order in which changed ports are re-initialized, most critical first
+enum PortPriority {
+  kPriorityClock,   // sends or receives the MIDI clock
+  kPrioritySurface, // control surface
+  kPriorityHigh,    // configured high priority, or busy input
+  kPriorityInUse,   // attached at some point in this session
+  kPriorityOther,
+  kNumPriorities
+};
+static DeviceRules g_rules;
+
+static void loadRules();
+static bool usbIdAllowed(uint16_t vid, uint16_t pid);
+static bool usbDeviceAllowed(uint16_t vid, uint16_t pid, const char *path);
+static bool portNameAllowed(const char *name);
+static void learnPriorities();
+static void sampleTraffic();
+
+// Reconciliation of inputsList/outputsList with REAPER's ports after a
+// midi_reinit(), resumable so that it can be spread over several timer ticks.
+// Only ever touched from the thread that handles the reinit.
+struct PortRef {
+  int index;
+  bool output;
+};
+
+static inline void countReinit(const PortRef &port)
+{
+  std::vector<uint32_t> &reinits = g_portReinits[port.output ? 1 : 0];
+  if ((int)reinits.size() <= port.index) reinits.resize(port.index + 1, 0);
+  ++reinits[port.index];
+}
+
+struct PendingPort {
+  PortRef port;
+  int priority;     // PortPriority
+  std::string stem; // see portNameStem(), for pairing inputs with outputs
+  bool attaching;   // attached when scanned, so it should be up after its midi_init
+  bool done;        // already initialized together with its counterpart
+};
+
+static int portPriority(const PortRef &port, const char *name);
+
+static struct {
+  bool active;
+  bool attachOnly;              // only bring up newly attached ports
+  bool reinited;                // follows a midi_reinit, which reopened every attached port
+  bool reinitIfIdle;            // stands in for a midi_reinit, see reinitForDeviceChange()
+  PortRef scanned;              // next port to check for changes
+  std::vector<PendingPort> pending; // changed ports awaiting midi_init
+  size_t nextPending;
+  std::vector<PortRef> unattached; // ports expected to come up that didn't, see beginVerify()
+  int numPorts[2];                 // input/output counts before the reinit
+  int ticks;
+  int calls; // midi_init calls made
+  std::chrono::steady_clock::time_point started;
+  double workMs;       // spent in reconcileStep(), without the gaps between ticks
+  unsigned generation; // bumped by each beginReconcile(), tags the queued WM_MIDI_RECONCILE on Windows
+} g_reconcile;
+
+static struct {
+  int count;
+  int lastTicks;
+  int maxTicks;
+  int lastPorts;
+  int lastCalls;  // midi_init calls, fewer than lastPorts when ports were paired
+  double lastMs;
+  int totalPorts;
+  int totalCalls;
+} g_reconcileStats;
+
+// time from reinit until a port of each PortPriority class was ready
+static struct {
+  int count;
+  double lastMs;
+  double totalMs;
+} g_readyStats[kNumPriorities];
+
+// ports that have been attached at some point, they get re-initialized first
+static std::vector<bool> inputsInUse;
+static std::vector<bool> outputsInUse;
+
+// Priorities learned from REAPER's configuration (clock outputs, control
+// surface devices, see learnPriorities()) and from input traffic, by port index.
+static std::vector<bool> clockOutputs;
+static std::vector<bool> surfaceInputs, surfaceOutputs;
+static std::vector<unsigned> inputTraffic; // events seen per input, see sampleTraffic()
+static int g_lastTrafficSeq = 0;
+
+// user settings, from REAPER's extended state (section EXTSTATE_SECTION)
+#define EXTSTATE_SECTION "sockmonkey72_automidireset"
+static struct {
+  double sliceBudgetMs; // "slice_budget_ms": main thread time per timer tick spent reconciling
+  bool pairPorts;       // "pair_ports": one midi_init(in, out) for both directions of a device
+  double quarantineMs;  // "quarantine_ms": devices slower than this to open aren't reopened unless they changed, or retried (0: off)
+  double stallThresholdMs; // "stall_threshold_ms": keep the stage breakdown of invocations slower than this
+  double metricsIntervalS; // "metrics_interval_s": how often to write automidireset.prom (0: never)
+  double maxPlaybackReinitMs; // "max_playback_reinit_ms": don't defer reinits benchmarked faster than this during playback (0: off)
+  int shadowMode;       // "shadow_mode": compare each full reinit with a targeted plan (1), and log it (2)
+  double sweepMaxIntervalS; // "sweep_max_interval_s": slowest anti-entropy sweep, when nothing changes (0: off)
+  double dedupWindowMs; // "dedup_window_ms": reports of one device within this long count once (0: off)
+  int broker;           // "broker": share one USB monitor between REAPER instances (Linux)
+  int servicePolicy;    // "service_policy": service thread scheduling, 0 SCHED_IDLE, 1 SCHED_BATCH, 2 SCHED_OTHER (Linux)
+  uint64_t serviceCpus; // "service_cpus": CPU mask the service thread may run on, eg. 3 for CPUs 0-1 (0: any; Linux)
+  int deferPolicy;      // "defer_reinit": 0 never, 1 while recording, 2 while playing or recording
+  double maxDeferMs;    // "max_defer_ms": run the full reinit anyway after this long
+} g_settings;
+
+// full reinits held back while the transport is running, see reinitDeferred()
+static struct {
+  bool active;
+  bool targetedDone; // newly attached ports already brought up during this deferral
+  std::chrono::steady_clock::time_point since;
+  std::vector<PortRef> targeted; // the ports those targeted reconciles brought up, see fullReinit()
+} g_defer;
+
+static struct {
+  int count;
+  double totalMs;
+  double maxMs;
+} g_deferStats;
+
+static bool reinitDeferred();
+static void endDeferral();
+static void fullReinit();
+
+// Shadow mode ("shadow_mode" 1, or 2 to log every comparison): before each
+// full reinit, work out which ports a targeted reconcile (no midi_reinit)
+// would have touched and what it would have cost, then compare that with
+// what the full reinit and reconcile actually did.
+static struct {
+  bool active;
+  std::vector<bool> predicted[2]; // attached state seen without midi_reinit, by direction
+  std::vector<PortRef> plan;      // ports the targeted reconcile would midi_init
+  double estimatedMs;             // their open cost, from the profile
+  double reinitMs;                // midi_reinit, measured
+} g_shadow;
+
+static struct {
+  int runs;
+  int matched;      // the targeted plan would have ended in the same state
+  int portsPlanned;
+  int portsActual;
+  double estimatedMs;
+  double actualMs;
+} g_shadowStats;
+
+static void shadowPlan();
+static void shadowCompare();
+
+// Anti-entropy sweep: a cheap fingerprint of the OS device set is compared
+// with the one at the last reconcile, to catch notifications that were lost
+// or came too early. The interval starts at SWEEP_MIN_INTERVAL_MS after any
+// activity and doubles while nothing changes, up to sweep_max_interval_s.
+// On Linux the service thread sweeps against the device registry instead.
+#define SWEEP_MIN_INTERVAL_MS 1000
+
+struct SweepSchedule {
+  int intervalMs;
+  std::chrono::steady_clock::time_point next;
+
+  void activity()
+  {
+    intervalMs = SWEEP_MIN_INTERVAL_MS;
+    next = std::chrono::steady_clock::now() + std::chrono::milliseconds(intervalMs);
+  }
+  // true if a sweep is due, and schedules the one after it
+  bool due()
+  {
+    if (g_settings.sweepMaxIntervalS <= 0.) return false;
+    const auto now = std::chrono::steady_clock::now();
+    if (now < next) return false;
+    intervalMs = std::min(intervalMs * 2, (int)(g_settings.sweepMaxIntervalS * 1000.));
+    next = now + std::chrono::milliseconds(std::max(intervalMs, SWEEP_MIN_INTERVAL_MS));
+    return true;
+  }
+};
+
+static inline void fingerprintMix(uint64_t &hash, uint64_t value)
+{
+  hash = (hash ^ value) * 1099511628211ull; // FNV-1a
+}
+
+#ifdef __linux__
+static SweepSchedule g_usbSweep; // see usb_sweep()
+
+// Suspend/resume: CLOCK_BOOTTIME keeps running through a suspend and
+// CLOCK_MONOTONIC doesn't, so a jump in their difference means the system
+// just woke up. Every USB device then drops off and re-enumerates over a few
+// seconds, which would restart the debounce dozens of times and let it expire
+// midway. In resume mode the debounce instead waits until the device tree has
+// been quiet for RESUME_QUIET_MS (at most RESUME_MAX_MS), then reinits once.
+#define RESUME_JUMP_MS 1000
+#define RESUME_QUIET_MS 3000
+#define RESUME_MAX_MS 30000
+
+struct ResumeDetector {
+  bool primed;
+  int64_t lastOffsetMs;
+
+  // offsetMs: CLOCK_BOOTTIME - CLOCK_MONOTONIC. Returns the time spent
+  // suspended since the last call, or 0.
+  int64_t check(int64_t offsetMs)
+  {
+    int64_t jumpMs = primed ? offsetMs - lastOffsetMs : 0;
+    primed = true;
+    lastOffsetMs = offsetMs;
+    return jumpMs >= RESUME_JUMP_MS ? jumpMs : 0;
+  }
+};
+
+static std::atomic<int64_t> g_resumeDetectedMs; // service thread -> timer: time suspended, self-contained so relaxed
+
+static struct {
+  bool active;
+  int events; // device events folded into this resume
+  std::chrono::steady_clock::time_point since;
+} g_resume;
+
+static struct {
+  int count;
+  int lastEvents;
+  double lastSettleMs;    // resume detected -> reinit
+  double totalSuspendedS;
+} g_resumeStats;
+
+static int64_t suspendClockOffsetMs();
+static void beginResume(int64_t suspendedMs);
+static void endResume();
+
+// Broker mode ("broker" setting): REAPER instances on one machine share one
+// libusb monitor. The instance that binds the abstract socket first owns USB
+// monitoring and classification, and forwards every classified event to the
+// others, which don't touch libusb at all. The socket goes away with its
+// owner, and the subscribers then race to bind it and take over. Abstract
+// sockets have no permissions, so both ends check that the peer runs as the
+// same user; if someone else holds the name, this instance monitors alone.
+#define BROKER_MAGIC 0x414D5231 // "AMR1"
+#define BROKER_RETRY_MS 100
+
+enum BrokerRole {
+  kBrokerOff,
+  kBrokerOwner,
+  kBrokerSubscriber
+};
+
+enum BrokerEventType {
+  kBrokerArrived,
+  kBrokerLeft,
+  kBrokerChanged // from the ALSA fallback, nothing known about the device
+};
+
+struct BrokerEvent {
+  uint32_t magic;
+  uint8_t type;     // BrokerEventType
+  uint8_t reserved;
+  uint16_t vid;
+  uint16_t pid;
+  int16_t inputs;   // arrivals only, 0/0: unknown
+  int16_t outputs;
+  char path[32];    // usb_device_path(), arrivals and departures
+};
+
+static struct {
+  std::atomic<int> role; // BrokerRole; the service thread changes it on failover, showInfo() reads it relaxed
+  int fd;                // listening (owner) or connected (subscriber) socket
+  std::vector<int> subscribers; // service thread only
+  std::atomic<int> numSubscribers;
+  std::atomic<int> failovers;
+  std::atomic<int> rejected; // peers running as another user, dropped
+  bool foreignOwner;         // brokerOpen() found the name bound by another user
+} g_broker;
+
+static bool brokerOpen();
+static void brokerClose();
+static void brokerPublish(BrokerEventType type, uint16_t vid, uint16_t pid, const midi_port_counts *counts, const char *path);
+static void brokerServe();
+static void brokerReceive();
+#else
+static struct {
+  SweepSchedule schedule;
+  uint64_t reconciled; // fingerprint at the last reconcile
+} g_sweep;
+
+static uint64_t osDeviceFingerprint();
+static bool sweepMismatch();
+#endif
+
+// Stall watchdog: every plugin invocation on REAPER's thread (the Windows
+// window thread for the WM_MIDI_* messages) is timed into a histogram, and
+// the REAPER calls it makes are recorded as stages so that an invocation
+// slower than "stall_threshold_ms" can be broken down afterwards. Only one
+// thread does watched work on each platform, so this state needs no locking.
+enum WatchInvocation {
+  kWatchTimer,
+  kWatchReinitMsg, // in WM_MIDI_REINIT order
+  kWatchInitMsg,
+  kWatchReconcileMsg,
+  kWatchVerifyMsg,
+  kNumWatchInvocations
+};
+
+enum WatchStage {
+  kStageMidiReinit,
+  kStageMidiInit,
+  kStagePortName,
+  kStagePortCount,
+  kStagePlayState,
+  kStageTraffic,
+  kStageReaperIni,
+  kStageProfile,
+  kNumWatchStages
+};
+
+struct WatchEntry {
+  uint8_t stage;
+  int16_t arg;        // port index, where it applies
+  uint32_t startUs;   // since the invocation began
+  uint32_t durationUs;
+};
+
+#define MAX_WATCH_ENTRIES 256
+#define WATCH_HISTOGRAM_BUCKETS 24 // log2 of the duration in us, up to ~8 s
+
+struct WatchRecord {
+  int invocation;
+  int numEntries;
+  int dropped;
+  double totalMs;
+  WatchEntry entries[MAX_WATCH_ENTRIES];
+};
+
+static struct {
+  bool active;
+  std::chrono::steady_clock::time_point started;
+  WatchRecord current;
+} g_watch;
+
+static struct {
+  uint32_t histogram[kNumWatchInvocations][WATCH_HISTOGRAM_BUCKETS];
+  double totalUs[kNumWatchInvocations];
+  int stalls;
+  WatchRecord lastStall;
+} g_watchStats;
+
+static inline uint32_t usSince(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now)
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - since).count();
+}
+
+static void watchBegin(int invocation);
+static void watchEnd();
+
+// times one REAPER call (or a group of them) made during a watched invocation
+struct WatchScope {
+  WatchScope(int stage, int arg = -1) : stage(stage), arg(arg)
+  {
+    if (g_watch.active) start = std::chrono::steady_clock::now();
+  }
+  ~WatchScope()
+  {
+    if (!g_watch.active) return;
+
+    WatchRecord &record = g_watch.current;
+    if (record.numEntries >= MAX_WATCH_ENTRIES) {
+      ++record.dropped;
+      return;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    record.entries[record.numEntries++] = WatchEntry { (uint8_t)stage, (int16_t)arg, usSince(g_watch.started, start), usSince(start, end) };
+  }
+  int stage;
+  int arg;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Flight recorder: the last FLIGHT_RECORDER_SIZE events from every thread,
+// for post-mortems (see dumpTrace()). Recording is a fetch_add and a few
+// relaxed stores into a fixed ring, without locks or allocations; each
+// slot's seq says which event it holds, so a reader can skip slots that are
+// being overwritten. With "flight_recorder_file" the ring is a memory-mapped
+// file per process, automidireset-flight-<pid>.bin, so it survives a crash;
+// the next start moves the newest one left by a process that's gone to
+// automidireset-flight.prev.bin, and dumpTrace() exports it alongside.
+enum FlightEventType {
+  kFlightHotplugArrived, // arg: bus/address, value: expected ports (in << 16 | out)
+  kFlightHotplugLeft,    // arg: bus/address
+  kFlightNotify,         // CoreMIDI/WM_DEVICECHANGE notification
+  kFlightDebounceStart,
+  kFlightDebounceRestart,
+  kFlightReinitDeferred,
+  kFlightMidiReinit,     // value: duration (us)
+  kFlightMidiInit,       // arg: input << 16 | output (0xFFFF: none), value: duration (us)
+  kFlightReconcile,      // arg: ports, value: duration (us)
+  kFlightVerify,         // arg: ports left to verify
+  kFlightSweepMismatch,  // the device set changed without a notification
+  kFlightResume,         // value: time suspended (ms)
+  kFlightDuplicate,      // arg: MetricsSource, value: 1 if the first report came from another source
+  kNumFlightEventTypes
+};
+
+enum FlightThread {
+  kFlightMainThread,
+  kFlightServiceThread,
+  kFlightWindowThread,
+};
 
+struct FlightSlot {
+  std::atomic<uint64_t> seq;  // event number + 1, 0 while empty
+  std::atomic<uint64_t> time; // ns, steady clock
+  std::atomic<uint64_t> data; // type << 56 | thread << 48 | value
+  std::atomic<uint64_t> arg;  // (uint32_t)arg
+};
+
+#define FLIGHT_RECORDER_SIZE 8192
+#define FLIGHT_RECORDER_MAGIC "AMRFLT02"
+
+struct FlightRecorderHeader {
+  char magic[8];
+  uint32_t size;
+  uint32_t reserved;
+  std::atomic<uint64_t> head;
+};
+
+// the thread that runs the reconciler
+#ifdef WIN32
+#define FLIGHT_REAPER_THREAD kFlightWindowThread
+#else
+#define FLIGHT_REAPER_THREAD kFlightMainThread
+#endif
+
+static struct {
+  FlightRecorderHeader *header;
+  FlightSlot *slots;
+  void *mapping;
+  size_t mappingSize;
+} g_flight;
+
+static void openFlightRecorder();
+static void closeFlightRecorder();
+
+static inline uint64_t flightNow()
+{
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void flightRecordAt(uint64_t time, int type, int thread, int arg, uint32_t value)
+{
+  if (!g_flight.header) return;
+
+  uint64_t n = g_flight.header->head.fetch_add(1, std::memory_order_relaxed);
+  FlightSlot &slot = g_flight.slots[n % FLIGHT_RECORDER_SIZE];
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.time.store(time, std::memory_order_relaxed);
+  slot.data.store(((uint64_t)type << 56) | ((uint64_t)thread << 48) | value, std::memory_order_relaxed);
+  slot.arg.store((uint32_t)arg, std::memory_order_relaxed);
+  slot.seq.store(n + 1, std::memory_order_release);
+}
+
+static inline void flightRecord(int type, int thread, int arg = 0, uint32_t value = 0)
+{
+  flightRecordAt(flightNow(), type, thread, arg, value);
+}
+
+static bool dumpTrace(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd);
+
+// Self-benchmark (see runBenchmark()): min, median and max of each operation,
+// saved to <resource path>/automidireset-bench.txt. The midi_init timings go
+// into the open cost profile; the midi_reinit median is loaded at startup
+// and lets reinitDeferred() allow cheap reinits during playback.
+#define BENCH_REINIT_RUNS 5
+#define BENCH_INIT_RUNS 3
+#define BENCH_SCAN_RUNS 5
+
+struct BenchTiming {
+  double minMs;
+  double medianMs;
+  double maxMs;
+};
+
+static double g_benchReinitMs = -1.; // median midi_reinit, < 0 if never measured
+static double g_pluginLoadMs = -1.;  // time spent in REAPER_PLUGIN_ENTRYPOINT at load
+static BenchTiming g_benchNotify;     // subscriber delivery latency, handed from runBenchmark() to benchmark()
+static bool g_benchNotifyValid = false;
+
+static bool runBenchmark(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd);
+static void loadBenchmark();
+#ifdef WIN32
+static std::atomic<std::string *> g_benchOutput; // benchmark() on the window thread to printBenchmark()
+static bool g_benchPending = false;              // REAPER's thread only
+static void printBenchmark();
+#endif
+
+// Counters and gauges for fleet monitoring, written as a Prometheus textfile
+// (see writeMetrics()). Counters are bumped from any thread.
+enum MetricsSource {
+  kSourceLibusb,
+  kSourceCoreMIDI,
+  kSourceWindows,
+  kSourceSweep,   // missed events caught by the anti-entropy sweep
+  kSourceBroker,  // forwarded by another instance's monitor (Linux)
+  kSourceAlsa,    // ALSA device nodes, when libusb isn't available (Linux)
+  kNumMetricsSources
+};
+
+static struct {
+  std::atomic<uint64_t> events[kNumMetricsSources];
+  std::atomic<uint64_t> fullReinits;
+  std::atomic<uint64_t> targetedReinits;
+  std::atomic<uint64_t> coalescedEvents;  // folded into a debounce already running
+  std::atomic<uint64_t> excludedEvents;   // dropped by the device rules
+  std::atomic<uint64_t> deferredReinits;
+  std::atomic<uint64_t> removalsResolved;   // removals found in the device registry
+  std::atomic<uint64_t> arrivalsClassified; // arrivals whose descriptors were read and classified
+  std::atomic<uint64_t> resumes;          // system resumes from suspend (Linux)
+  std::atomic<uint64_t> firstReports;     // device reports that started or restarted the debounce, see dedupReport()
+  std::atomic<uint64_t> duplicateReports[2]; // the same device again within the window: same source, another source
+  std::atomic<uint64_t> anonymousDuplicates; // reports without an identity, folded into a recent identified one
+  double debounceWaitMs;                  // reconciler thread only
+  uint64_t debounceCount;
+  std::chrono::steady_clock::time_point debounceStarted;
+  std::chrono::steady_clock::time_point lastWrite;
+} g_metrics;
+
+static void noteDebounceStart();
+static void noteDebounceEnd();
+static void maybeWriteMetrics();
+
+// One plug-in is often reported more than once: by the sweep and then by
+// libusb, by every ALSA node of a card, or by each interface of a device on
+// Windows. Reports are linked to the physical device ("bus path VID:PID
+// serial") and only the first one within "dedup_window_ms" starts or
+// restarts the debounce; the rest can only add the port counts the first
+// one lacked. Owned by the thread that receives the device events: the
+// service thread on Linux, the window thread on Windows.
+struct DedupEntry {
+  std::chrono::steady_clock::time_point first;
+  int source;   // MetricsSource of the first report
+  bool counted; // its port counts are in g_expected*
+};
+
+static struct {
+  std::unordered_map<std::string, DedupEntry> recent; // '+' or '-' (arrived, left) and the identity
+  std::chrono::steady_clock::time_point lastFirst;
+} g_dedup;
+
+static bool dedupReport(const std::string &identity, bool arrived, int source, DedupEntry **entry);
+static bool dedupAnonymous();
+
+static double getSetting(const char *key, double defaultValue);
+static void loadConfig();
 static void initLists();
-static void updateLists();
+static void beginReconcile(bool attachOnly, bool reinited);
+static bool reconcileStep(double budgetMs);
+
+// Ports the reconcile expected to come up but found detached (new slots,
+// or ports that were attached when scanned and dropped in their midi_init)
+// get re-checked and retried with midi_init (never midi_reinit) with an
+// exponential backoff, in case their device was still binding. Ports of
+// removed devices are never retried. See beginVerify() and verifyStep().
+#define VERIFY_FIRST_DELAY_MS 250
+#define VERIFY_MAX_RETRIES 5
+
+struct RetryPort {
+  PortRef port;
+  int retries;
+};
+
+static struct {
+  bool active;
+  std::vector<RetryPort> ports;
+  int round;
+  std::chrono::steady_clock::time_point started; // reconcile start
+  std::chrono::steady_clock::time_point next;
+} g_verify;
+
+// outcome of the latest verifications, most recent last
+struct VerifyResult {
+  std::string name;
+  bool output;
+  int retries;
+  double attachedMs; // since the reconcile started, < 0 if never attached
+};
+#define MAX_VERIFY_RESULTS 16
+static std::vector<VerifyResult> g_verifyResults;
+
+static struct {
+  int lateAttached;
+  int failed;
+} g_verifyStats;
+
+static void beginVerify();
+static int verifyStep();
+
+// Rolling midi_init cost per device (keyed by portNameStem()), kept across
+// sessions in <resource path>/automidireset-profile.txt.
+struct OpenCost {
+  double avgMs; // exponentially weighted
+  double maxMs;
+  int count;
+};
+#define OPEN_COST_WEIGHT 0.2
+#define QUARANTINE_MIN_SAMPLES 3
+static std::unordered_map<std::string, OpenCost> g_openCosts;
+static bool g_openCostsDirty = false;
+
+static void loadOpenCosts();
+static void saveOpenCosts();
+static void timedMidiInit(int input, int output, const std::string &stem);
+static bool quarantined(const std::string &stem);
 static bool loadAPI(void *(*getFunc)(const char *));
 static void registerCustomAction();
+static void registerScriptAPI();
+static void dropSubscribers();
 static bool showInfo(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd);
 
 extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
   REAPER_PLUGIN_HINSTANCE instance, reaper_plugin_info_t *rec)
 {
+  const auto loadStart = std::chrono::steady_clock::now();
+
 #ifdef WIN32
 
   if (!rec) {
+    dropSubscribers();
+    if (g_benchPending) plugin_register("-timer", (void *)printBenchmark);
     return 0;
   }
   if (rec->caller_version != REAPER_PLUGIN_VERSION
@@ -116,6 +1037,8 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
     return 0;
   }
 
+  loadConfig();
+
   // initLists called in the window_thread on Windows
   HANDLE wt = CreateThread(NULL, 0, window_thread, kMidiDeviceType, 0, 0);
   if (wt == INVALID_HANDLE_VALUE) {
@@ -126,12 +1049,19 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
 #elif __linux__
 
   if (!rec) {
-    if (g_usbInited) {
-      g_usbInited = false;
-      plugin_register("-timer", NULL);
+    if (g_usbInited.load(std::memory_order_relaxed)) {
+      g_usbInited.store(false, std::memory_order_relaxed);
+      plugin_register("-timer", (void *)reaperTimer);
       g_usbServiceThread.join();
-      libusb_exit(NULL);
+      if (g_usbRunning) {
+        usbStop();
+      }
+      alsaStop();
+      brokerClose();
+      usbUnload();
     }
+    dropSubscribers();
+    closeFlightRecorder();
     return 0;
   }
   if (rec->caller_version != REAPER_PLUGIN_VERSION
@@ -140,47 +1070,12 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
     return 0;
   }
 
-  g_usbInited = true;
-  libusb_init(NULL);
-
-  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
-    ShowConsoleMsg("automidireset: Hotplug not supported by this build of libusb\n");
-    libusb_exit (NULL);
-    g_usbInited = false;
-  }
-
-  int rc;
-  if (g_usbInited) {
-    rc = libusb_hotplug_register_callback (NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, (libusb_hotplug_flag)0, LIBUSB_HOTPLUG_MATCH_ANY,
-                                          LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &g_hp[0]);
-    if (LIBUSB_SUCCESS != rc) {
-      ShowConsoleMsg("Error registering callback 0\n");
-      libusb_exit (NULL);
-      g_usbInited = false;
-    }
-  }
-
-  if (g_usbInited) {
-    rc = libusb_hotplug_register_callback (NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, (libusb_hotplug_flag)0, LIBUSB_HOTPLUG_MATCH_ANY,
-                                          LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &g_hp[1]);
-    if (LIBUSB_SUCCESS != rc) {
-      ShowConsoleMsg("Error registering callback 1\n");
-      libusb_exit (NULL);
-      g_usbInited = false;
-    }
-  }
+  loadConfig();
 
-  if (g_usbInited) {
-    g_usbServiceThread = thread([&]() {
-      timeval tv;
-      while (g_usbInited) {
-        tv.tv_sec = 0;
-        tv.tv_usec = 500;
-        libusb_handle_events_timeout(NULL, &tv);
-        std::this_thread::sleep_for(1ms);
-      }
-    });
-  }
+  // libusb, the broker and the fallback are all set up on the service thread
+  resetDeviceEvents();
+  g_usbInited.store(true, std::memory_order_relaxed);
+  g_usbServiceThread = thread(serviceThread);
 
 #else // __APPLE__
 
@@ -188,10 +1083,12 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
 
   if (!rec) {
     if (g_MIDIClient) {
-      plugin_register("-timer", NULL);
+      plugin_register("-timer", (void *)reaperTimer);
       MIDIClientDispose(g_MIDIClient);
       g_MIDIClient = 0;
     }
+    dropSubscribers();
+    closeFlightRecorder();
     return 0;
   }
   if (rec->caller_version != REAPER_PLUGIN_VERSION
@@ -200,7 +1097,10 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
     return 0;
   }
 
+  loadConfig();
+
   // set up MIDI Client for this instance
+  resetDeviceEvents();
   err = MIDIClientCreate(CFSTR("reaper_automidireset"), (MIDINotifyProc)notifyProc, NULL, &g_MIDIClient);
   if (err || !g_MIDIClient) {
     return 0;
@@ -211,15 +1111,187 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
 #ifndef WIN32 // __linux__ or __APPLE__
 
   g_listsInited = false;
-  g_eventReceived = false;
   plugin_register("timer", (void *)reaperTimer);
 
 #endif
 
   registerCustomAction();
+  registerScriptAPI();
+  g_pluginLoadMs = elapsedMs(loadStart);
   return 1;
 }
 
+// The statistics part of showInfo(), run where the state lives: REAPER's
+// thread, or the window thread on Windows. See publishStatus().
+static void appendStats(std::string &info)
+{
+  char infoString[512];
+
+  if (g_reconcileStats.count) {
+    snprintf(infoString, 512, "\n\nReconciles: %d (last: %d ports in %d midi_init calls, %d ticks, %.1f ms; max %d ticks)"
+             "\n  midi_init calls: %d for %d ports",
+             g_reconcileStats.count, g_reconcileStats.lastPorts, g_reconcileStats.lastCalls, g_reconcileStats.lastTicks,
+             g_reconcileStats.lastMs, g_reconcileStats.maxTicks, g_reconcileStats.totalCalls, g_reconcileStats.totalPorts);
+    info += infoString;
+  }
+  static const char * const priorityNames[kNumPriorities] = { "clock", "surface", "high", "in use", "other" };
+  for (int i = 0; i < kNumPriorities; ++i) {
+    if (!g_readyStats[i].count) continue;
+    snprintf(infoString, 512, "\n  %s ports ready after: %.1f ms (mean %.1f ms, %d ports)", priorityNames[i],
+             g_readyStats[i].lastMs, g_readyStats[i].totalMs / g_readyStats[i].count, g_readyStats[i].count);
+    info += infoString;
+  }
+  if (g_verifyStats.lateAttached || g_verifyStats.failed) {
+    snprintf(infoString, 512, "\nPorts verified after reconcile: %d attached late, %d never attached",
+             g_verifyStats.lateAttached, g_verifyStats.failed);
+    info += infoString;
+    for (const VerifyResult &result : g_verifyResults) {
+      if (result.attachedMs >= 0) {
+        snprintf(infoString, 512, "\n  %s %s: attached after %.0f ms, %d retries", result.output ? "OUTPUT" : "INPUT",
+                 result.name.c_str(), result.attachedMs, result.retries);
+      }
+      else {
+        snprintf(infoString, 512, "\n  %s %s: not attached after %d retries", result.output ? "OUTPUT" : "INPUT",
+                 result.name.c_str(), result.retries);
+      }
+      info += infoString;
+    }
+  }
+  if (g_benchReinitMs >= 0.) {
+    snprintf(infoString, 512, "\nBenchmarked midi_reinit: %.1f ms (median)", g_benchReinitMs);
+    info += infoString;
+  }
+  if (!g_openCosts.empty()) {
+    // the slowest devices to open, flagged if they're quarantined
+    std::vector<std::pair<double, const std::string *>> costs;
+    for (const auto &entry : g_openCosts) {
+      costs.push_back(std::make_pair(entry.second.avgMs, &entry.first));
+    }
+    std::sort(costs.rbegin(), costs.rend());
+    info += "\nSlowest devices to open (midi_init):";
+    for (size_t i = 0; i < costs.size() && i < 5; ++i) {
+      const OpenCost &cost = g_openCosts[*costs[i].second];
+      snprintf(infoString, 512, "\n  %s: %.1f ms (max %.1f ms, %d opens)%s", costs[i].second->c_str(),
+               cost.avgMs, cost.maxMs, cost.count, quarantined(*costs[i].second) ? " [quarantined]" : "");
+      info += infoString;
+    }
+  }
+  static const char * const invocationNames[kNumWatchInvocations] = { "timer", "WM_MIDI_REINIT", "WM_MIDI_INIT", "WM_MIDI_RECONCILE", "WM_MIDI_VERIFY" };
+  static const char * const stageNames[kNumWatchStages] = { "midi_reinit", "midi_init", "GetMIDI*Name", "GetNumMIDI*", "GetPlayState", "MIDI_GetRecentInputEvent", "reaper.ini", "profile save" };
+  info += "\nInvocation times (count per duration):";
+  for (int i = 0; i < kNumWatchInvocations; ++i) {
+    std::string line;
+    for (int b = 0; b < WATCH_HISTOGRAM_BUCKETS; ++b) {
+      if (!g_watchStats.histogram[i][b]) continue;
+      char bucket[64];
+      snprintf(bucket, sizeof(bucket), " <%.3gms:%u", (2u << b) / 1000., g_watchStats.histogram[i][b]);
+      line += bucket;
+    }
+    if (line.empty()) continue;
+    snprintf(infoString, 512, "\n  %s:", invocationNames[i]);
+    info += infoString;
+    info += line;
+  }
+  if (g_watchStats.stalls) {
+    const WatchRecord &stall = g_watchStats.lastStall;
+    double stageMs[kNumWatchStages] = { 0. };
+    int stageCount[kNumWatchStages] = { 0 };
+    const WatchEntry *slowest = NULL;
+    for (int i = 0; i < stall.numEntries; ++i) {
+      const WatchEntry &entry = stall.entries[i];
+      stageMs[entry.stage] += entry.durationUs / 1000.;
+      ++stageCount[entry.stage];
+      if (!slowest || entry.durationUs > slowest->durationUs) slowest = &entry;
+    }
+    snprintf(infoString, 512, "\nStalls over %.0f ms: %d, last: %s, %.1f ms%s", g_settings.stallThresholdMs, g_watchStats.stalls,
+             invocationNames[stall.invocation], stall.totalMs, stall.dropped ? " (stages truncated)" : "");
+    info += infoString;
+    for (int i = 0; i < kNumWatchStages; ++i) {
+      if (!stageCount[i]) continue;
+      snprintf(infoString, 512, "\n  %s: %.1f ms in %d calls", stageNames[i], stageMs[i], stageCount[i]);
+      info += infoString;
+    }
+    if (slowest) {
+      snprintf(infoString, 512, "\n  slowest call: %s (port %d) at +%.1f ms, %.1f ms", stageNames[slowest->stage], slowest->arg,
+               slowest->startUs / 1000., slowest->durationUs / 1000.);
+      info += infoString;
+    }
+  }
+  if (g_shadowStats.runs) {
+    snprintf(infoString, 512, "\nShadow mode: %d of %d targeted plans matched the full reinit;"
+             " %d vs %d ports, estimated %.1f ms vs %.1f ms actual",
+             g_shadowStats.matched, g_shadowStats.runs, g_shadowStats.portsPlanned, g_shadowStats.portsActual,
+             g_shadowStats.estimatedMs, g_shadowStats.actualMs);
+    info += infoString;
+  }
+  if (g_deferStats.count) {
+    snprintf(infoString, 512, "\nReinits deferred for the transport: %d (total %.1f s, max %.1f s)",
+             g_deferStats.count, g_deferStats.totalMs / 1000., g_deferStats.maxMs / 1000.);
+    info += infoString;
+  }
+#ifdef __linux__
+  if (const char *status = g_monitorStatus.load(std::memory_order_relaxed)) {
+    snprintf(infoString, 512, "\nDevice monitor: %s", status);
+    info += infoString;
+  }
+  const int brokerRole = g_broker.role.load(std::memory_order_relaxed);
+  if (brokerRole == kBrokerOwner) {
+    snprintf(infoString, 512, "\nBroker: monitoring USB for %d other instances (%d failovers)",
+             g_broker.numSubscribers.load(), g_broker.failovers.load());
+    info += infoString;
+  }
+  if (g_broker.rejected.load(std::memory_order_relaxed)) {
+    snprintf(infoString, 512, "\nBroker: %d connections from or to another user refused", g_broker.rejected.load());
+    info += infoString;
+  }
+  else if (brokerRole == kBrokerSubscriber) {
+    snprintf(infoString, 512, "\nBroker: subscribed to another instance's USB monitor (%d failovers)", g_broker.failovers.load());
+    info += infoString;
+  }
+  if (g_resumeStats.count) {
+    snprintf(infoString, 512, "\nResumes from suspend: %d (last: %d events settled in %.1f s; %.0f s suspended in total)",
+             g_resumeStats.count, g_resumeStats.lastEvents, g_resumeStats.lastSettleMs / 1000., g_resumeStats.totalSuspendedS);
+    info += infoString;
+  }
+#endif
+  if (g_metrics.events[kSourceSweep]) {
+    snprintf(infoString, 512, "\nDevice changes caught by the background sweep: %d", (int)g_metrics.events[kSourceSweep]);
+    info += infoString;
+  }
+  const uint64_t duplicates = g_metrics.duplicateReports[0] + g_metrics.duplicateReports[1] + g_metrics.anonymousDuplicates;
+  if (duplicates) {
+    const uint64_t reports = g_metrics.firstReports + duplicates;
+    snprintf(infoString, 512, "\nDuplicate device reports: %d of %d (%.0f%%; %d from another source, %d unidentified)",
+             (int)duplicates, (int)reports, 100. * duplicates / reports,
+             (int)g_metrics.duplicateReports[1], (int)g_metrics.anonymousDuplicates);
+    info += infoString;
+  }
+}
+
+// Owner of the reconcile state only. Gives up if readers have pinned every
+// spare slot; the next call catches up.
+void publishStatus()
+{
+  g_status.lastPublish = std::chrono::steady_clock::now();
+  const int current = g_status.current.load(std::memory_order_relaxed);
+  for (int i = 1; i < STATUS_SLOTS; ++i) {
+    int slot = (current + i) % STATUS_SLOTS;
+    if (g_status.readers[slot].load()) continue; // pairs with the reader's recheck
+
+    StatusSnapshot &snapshot = g_status.slots[slot];
+    snapshot.stats.clear();
+    appendStats(snapshot.stats);
+    collectMetrics(snapshot.metrics);
+    g_status.current.store(slot);
+    return;
+  }
+}
+
+void maybePublishStatus()
+{
+  if (elapsedMs(g_status.lastPublish) >= STATUS_INTERVAL_MS) publishStatus();
+}
+
 bool showInfo(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd)
 {
   if (command != commandId) return false;
@@ -229,6 +1301,23 @@ bool showInfo(KbdSectionInfo *sec, int command, int val, int val2, int relmode,
            VERSION_STRING, __DATE__,
            !midi_init ? "\n\nPlease update to REAPER 6.47+ for the most reliable experience." : "");
   ShowConsoleMsg(infoString);
+
+#ifndef WIN32
+  publishStatus(); // this is the owner's thread, so they may as well be current
+#endif
+  std::string info;
+  {
+    StatusReader reader;
+    info = reader.snapshot().stats;
+  }
+  if (!g_subscribers.empty()) {
+    char subscribers[128];
+    snprintf(subscribers, sizeof(subscribers), "\nSubscribers: %d, %d notifications",
+             (int)g_subscribers.size(), g_notifyStats.count);
+    info += subscribers;
+  }
+  info += "\n";
+  ShowConsoleMsg(info.c_str());
   return true;
 }
 
@@ -243,87 +1332,1921 @@ void registerCustomAction()
 
   commandId = plugin_register("custom_action", &action);
   plugin_register("hookcommand2", (void *)&showInfo);
+
+  custom_action_register_t traceAction {
+    0,
+    "SM72_AMSTRACE",
+    "sockmonkey72_automidireset: Save flight recorder trace",
+    nullptr
+  };
+
+  traceCommandId = plugin_register("custom_action", &traceAction);
+  plugin_register("hookcommand2", (void *)&dumpTrace);
+
+  custom_action_register_t benchAction {
+    0,
+    "SM72_AMSBENCH",
+    "sockmonkey72_automidireset: Benchmark MIDI device re-initialization",
+    nullptr
+  };
+
+  benchCommandId = plugin_register("custom_action", &benchAction);
+  plugin_register("hookcommand2", (void *)&runBenchmark);
 }
 
-static void initLists()
+// ReaScript API. Rather than polling GetMIDIInputName() across every port
+// on a defer loop, a script can compare AutoMIDIReset_GetGeneration() with
+// the last value it saw and only fetch the ports when it changes.
+
+static int AutoMIDIReset_GetGeneration()
 {
-  if (!midi_init) return;
+  PortTableReader reader;
+  return (int)reader.snapshot().generation;
+}
 
-  char portName[512];
-  inputsList.clear();
-  int numMIDIInputs = GetNumMIDIInputs();
-  for (int i = 0; i < numMIDIInputs; i++) {
-    portName[0] = '\0';
-    bool inputAttached = GetMIDIInputName(i, portName, 512);
-    inputsList.push_back(inputAttached);
-    // char cslMsg[512];
-    // snprintf(cslMsg, 512, "MIDI Init INPUT %d %s (%d)\n", i, portName, inputAttached);
-    // ShowConsoleMsg(cslMsg);
+// One line per port, fields separated by tabs: "in" or "out", index,
+// 1 if attached, name. All from the same snapshot as *generationOut.
+static bool AutoMIDIReset_GetPorts(char *bufOut, int bufOut_sz, int *generationOut)
+{
+  if (!bufOut || bufOut_sz <= 0) return false;
+
+  std::string table;
+  PortTableReader reader;
+  const PortSnapshot &snapshot = reader.snapshot();
+  for (int output = 0; output < 2; ++output) {
+    for (size_t i = 0; i < snapshot.ports[output].size(); ++i) {
+      const PortState &port = snapshot.ports[output][i];
+      char line[600];
+      snprintf(line, sizeof(line), "%s\t%d\t%d\t%s\n", output ? "out" : "in", (int)i, port.attached ? 1 : 0, port.name.c_str());
+      table += line;
+    }
   }
-  int numMIDIOutputs = GetNumMIDIOutputs();
-  for (int i = 0; i < numMIDIOutputs; i++) {
-    portName[0] = '\0';
+  if (generationOut) *generationOut = (int)snapshot.generation;
+  snprintf(bufOut, bufOut_sz, "%s", table.c_str());
+  return table.size() < (size_t)bufOut_sz;
+}
+
+// Runs where the statistics live: REAPER's thread, or the window thread on
+// Windows, which publishes them with publishStatus().
+void collectMetrics(MetricValues &metrics)
+{
+  uint64_t events = 0;
+  for (int i = 0; i < kNumMetricsSources; ++i) events += g_metrics.events[i];
+  const uint64_t duplicates = g_metrics.duplicateReports[0] + g_metrics.duplicateReports[1] + g_metrics.anonymousDuplicates;
+  const uint64_t reports = g_metrics.firstReports + duplicates;
+
+  metrics.assign({
+    { "events", (double)events },
+    { "reinits_full", (double)g_metrics.fullReinits },
+    { "reinits_targeted", (double)g_metrics.targetedReinits },
+    { "events_coalesced", (double)g_metrics.coalescedEvents },
+    { "events_duplicate", (double)duplicates },
+    { "dedup_ratio", reports ? (double)duplicates / reports : 0. },
+    { "debounce_wait_ms", g_metrics.debounceCount ? g_metrics.debounceWaitMs / g_metrics.debounceCount : 0. },
+    { "reconcile_count", (double)g_reconcileStats.count },
+    { "reconcile_ms", g_reconcileStats.lastMs },
+    { "reconcile_max_ticks", (double)g_reconcileStats.maxTicks },
+    { "ready_ms_clock", g_readyStats[kPriorityClock].lastMs },
+    { "ready_ms_surface", g_readyStats[kPrioritySurface].lastMs },
+    { "ready_ms_high", g_readyStats[kPriorityHigh].lastMs },
+    { "ready_ms_in_use", g_readyStats[kPriorityInUse].lastMs },
+    { "ready_ms_other", g_readyStats[kPriorityOther].lastMs },
+    { "stalls", (double)g_watchStats.stalls },
+  });
+}
+
+static bool findMetric(const MetricValues &metrics, const char *name, double *valueOut)
+{
+  for (const auto &metric : metrics) {
+    if (!strcmp(name, metric.first)) {
+      *valueOut = metric.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool AutoMIDIReset_GetMetric(const char *name, double *valueOut)
+{
+  if (!name || !valueOut) return false;
+
+#ifdef WIN32
+  // as of the window thread's last publish, at most STATUS_INTERVAL_MS ago
+  StatusReader reader;
+  return findMetric(reader.snapshot().metrics, name, valueOut);
+#else
+  MetricValues metrics; // this is the owner's thread
+  collectMetrics(metrics);
+  return findMetric(metrics, name, valueOut);
+#endif
+}
+
+static void *AutoMIDIReset_GetGeneration_vararg(void **arglist, int numparms)
+{
+  return (void *)(intptr_t)AutoMIDIReset_GetGeneration();
+}
+
+static void *AutoMIDIReset_GetPorts_vararg(void **arglist, int numparms)
+{
+  if (numparms < 3) return NULL;
+  return (void *)(intptr_t)AutoMIDIReset_GetPorts((char *)arglist[0], (int)(intptr_t)arglist[1], (int *)arglist[2]);
+}
+
+static void *AutoMIDIReset_GetMetric_vararg(void **arglist, int numparms)
+{
+  if (numparms < 2) return NULL;
+  return (void *)(intptr_t)AutoMIDIReset_GetMetric((const char *)arglist[0], (double *)arglist[1]);
+}
+
+static void notifySubscribers()
+{
+  PortSnapshot current;
+  {
+    PortTableReader reader;
+    if (reader.snapshot().generation == g_delivered.generation) return;
+    current = reader.snapshot();
+  }
+
+  std::vector<AutoMIDIReset_PortChange> changes;
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<PortState> &before = g_delivered.ports[output];
+    const std::vector<PortState> &after = current.ports[output];
+    for (size_t i = 0; i < std::max(before.size(), after.size()); ++i) {
+      const PortState *was = i < before.size() && before[i].attached ? &before[i] : nullptr;
+      const PortState *is = i < after.size() && after[i].attached ? &after[i] : nullptr;
+      if (was && (!is || was->name != is->name)) {
+        changes.push_back(AutoMIDIReset_PortChange { (int)sizeof(AutoMIDIReset_PortChange), AutoMIDIReset_PortRemoved, output, (int)i, was->name.c_str() });
+      }
+      if (is && (!was || was->name != is->name)) {
+        changes.push_back(AutoMIDIReset_PortChange { (int)sizeof(AutoMIDIReset_PortChange), AutoMIDIReset_PortAdded, output, (int)i, is->name.c_str() });
+      }
+      else if (is && was->reinits != is->reinits) {
+        changes.push_back(AutoMIDIReset_PortChange { (int)sizeof(AutoMIDIReset_PortChange), AutoMIDIReset_PortReinited, output, (int)i, is->name.c_str() });
+      }
+    }
+  }
+
+  if (!changes.empty()) {
+    // a callback may unsubscribe itself or another: only call those still subscribed
+    std::vector<std::pair<AutoMIDIReset_Callback, void *>> subscribers(g_subscribers);
+    for (const auto &subscriber : subscribers) {
+      if (std::find(g_subscribers.begin(), g_subscribers.end(), subscriber) == g_subscribers.end()) continue;
+      subscriber.first(changes.data(), (int)changes.size(), subscriber.second);
+    }
+    ++g_notifyStats.count;
+    if (g_notifyStats.latencyMs.size() >= NOTIFY_LATENCY_SAMPLES) {
+      g_notifyStats.latencyMs.erase(g_notifyStats.latencyMs.begin());
+    }
+    g_notifyStats.latencyMs.push_back(elapsedMs(current.published));
+  }
+  g_delivered = std::move(current);
+}
+
+static bool AutoMIDIReset_Subscribe(AutoMIDIReset_Callback callback, void *userData)
+{
+  if (!callback) return false;
+
+  const auto subscriber = std::make_pair(callback, userData);
+  if (std::find(g_subscribers.begin(), g_subscribers.end(), subscriber) != g_subscribers.end()) return false;
+
+  if (g_subscribers.empty()) {
+    PortTableReader reader;
+    g_delivered = reader.snapshot(); // only report what changes from here on
+    plugin_register("timer", (void *)notifySubscribers);
+  }
+  g_subscribers.push_back(subscriber);
+  return true;
+}
+
+static bool AutoMIDIReset_Unsubscribe(AutoMIDIReset_Callback callback, void *userData)
+{
+  auto it = std::find(g_subscribers.begin(), g_subscribers.end(), std::make_pair(callback, userData));
+  if (it == g_subscribers.end()) return false;
+
+  g_subscribers.erase(it);
+  if (g_subscribers.empty()) {
+    plugin_register("-timer", (void *)notifySubscribers);
+  }
+  return true;
+}
+
+void dropSubscribers()
+{
+  if (g_subscribers.empty()) return;
+
+  g_subscribers.clear();
+  plugin_register("-timer", (void *)notifySubscribers);
+}
+
+#define REGISTER_SCRIPT_API(name, def) \
+  plugin_register("API_" #name, (void *)&name); \
+  plugin_register("APIvararg_" #name, (void *)&name##_vararg); \
+  plugin_register("APIdef_" #name, (void *)def)
+
+void registerScriptAPI()
+{
+  REGISTER_SCRIPT_API(AutoMIDIReset_GetGeneration, "int\0\0\0"
+    "Changes whenever a MIDI port appears, disappears, attaches, detaches or is re-initialized. Re-read the ports when it does.");
+  REGISTER_SCRIPT_API(AutoMIDIReset_GetPorts, "bool\0char*,int,int*\0bufOut,bufOut_sz,generationOut\0"
+    "The MIDI ports, one per line with tab-separated fields: \"in\" or \"out\", index, 1 if attached, name. "
+    "Returns false if the buffer was too small.");
+  REGISTER_SCRIPT_API(AutoMIDIReset_GetMetric, "bool\0const char*,double*\0name,valueOut\0"
+    "Read a counter or latency: events, reinits_full, reinits_targeted, events_coalesced, events_duplicate, "
+    "dedup_ratio (duplicate share of device reports), debounce_wait_ms (mean), "
+    "reconcile_count, reconcile_ms (last), reconcile_max_ticks, ready_ms_clock/surface/high/in_use/other (last), stalls.");
+
+  plugin_register("API_AutoMIDIReset_Subscribe", (void *)&AutoMIDIReset_Subscribe);
+  plugin_register("API_AutoMIDIReset_Unsubscribe", (void *)&AutoMIDIReset_Unsubscribe);
+}
+
+#ifndef WIN32
+
+// Map a flight recorder file written by a previous process, read-only.
+// NULL if it's missing or not one of ours.
+static const FlightRecorderHeader *mapFlightFile(const std::string &path, size_t *size)
+{
+  *size = sizeof(FlightRecorderHeader) + FLIGHT_RECORDER_SIZE * sizeof(FlightSlot);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void *mapping = fstat(fd, &st) || (size_t)st.st_size != *size ? MAP_FAILED : mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+
+  const FlightRecorderHeader *header = (const FlightRecorderHeader *)mapping;
+  if (memcmp(header->magic, FLIGHT_RECORDER_MAGIC, 8) || header->size != FLIGHT_RECORDER_SIZE) {
+    munmap(mapping, *size);
+    return NULL;
+  }
+  return header;
+}
+
+// Instances sharing the resource directory each have their own file. Of
+// the files left by processes that are gone (crashed, or exited), keep the
+// newest as automidireset-flight.prev.bin.
+static void keepPreviousFlightFile(const std::string &dir)
+{
+  std::string newest;
+  time_t newestTime = 0;
+  if (DIR *d = opendir(dir.c_str())) {
+    while (dirent *entry = readdir(d)) {
+      int pid;
+      char suffix[8];
+      if (sscanf(entry->d_name, "automidireset-flight-%d.%7s", &pid, suffix) != 2 || strcmp(suffix, "bin")) continue;
+      if (pid == getpid() || !kill(pid, 0) || errno != ESRCH) continue; // ours, or still running
+
+      std::string path = dir + "/" + entry->d_name;
+      struct stat st;
+      if (stat(path.c_str(), &st)) continue;
+      if (newest.empty() || st.st_mtime >= newestTime) {
+        if (!newest.empty()) unlink(newest.c_str());
+        newest = path;
+        newestTime = st.st_mtime;
+      }
+      else {
+        unlink(path.c_str());
+      }
+    }
+    closedir(d);
+  }
+  if (!newest.empty()) rename(newest.c_str(), (dir + "/automidireset-flight.prev.bin").c_str());
+}
+
+#endif
+
+void openFlightRecorder()
+{
+  if (g_flight.header) return;
+
+#ifndef WIN32
+  if (getSetting("flight_recorder_file", 0.) != 0. && GetResourcePath) {
+    keepPreviousFlightFile(GetResourcePath());
+    char name[64];
+    snprintf(name, sizeof(name), "/automidireset-flight-%d.bin", (int)getpid());
+    std::string path = std::string(GetResourcePath()) + name;
+
+    size_t size = sizeof(FlightRecorderHeader) + FLIGHT_RECORDER_SIZE * sizeof(FlightSlot);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      void *mapping = ftruncate(fd, size) ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (mapping != MAP_FAILED) {
+        // the file is zero-filled, which is a valid initial state for the atomics
+        g_flight.mapping = mapping;
+        g_flight.mappingSize = size;
+        FlightRecorderHeader *header = (FlightRecorderHeader *)mapping;
+        memcpy(header->magic, FLIGHT_RECORDER_MAGIC, 8);
+        header->size = FLIGHT_RECORDER_SIZE;
+        g_flight.slots = (FlightSlot *)(header + 1);
+        g_flight.header = header;
+        return;
+      }
+    }
+  }
+#endif
+
+  static FlightRecorderHeader header;
+  static FlightSlot slots[FLIGHT_RECORDER_SIZE];
+  g_flight.slots = slots;
+  g_flight.header = &header;
+}
+
+void closeFlightRecorder()
+{
+#ifndef WIN32
+  if (g_flight.mapping) {
+    g_flight.header = NULL;
+    munmap(g_flight.mapping, g_flight.mappingSize);
+    g_flight.mapping = NULL;
+  }
+#endif
+}
+
+// Append the events of one ring as trace events of process pid; returns
+// the number written, counting on from written.
+static int writeTraceEvents(FILE *fp, const FlightRecorderHeader *header, const FlightSlot *slots, int pid, int written)
+{
+  static const char * const eventNames[kNumFlightEventTypes] = {
+    "hotplug arrived", "hotplug left", "notification", "debounce start", "debounce restart",
+    "reinit deferred", "midi_reinit", "midi_init", "reconcile", "verify", "sweep mismatch", "resume", "duplicate"
+  };
+
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  uint64_t first = head > FLIGHT_RECORDER_SIZE ? head - FLIGHT_RECORDER_SIZE : 0;
+  for (uint64_t n = first; n < head; ++n) {
+    const FlightSlot &slot = slots[n % FLIGHT_RECORDER_SIZE];
+    if (slot.seq.load(std::memory_order_acquire) != n + 1) continue;
+    uint64_t time = slot.time.load(std::memory_order_relaxed);
+    uint64_t data = slot.data.load(std::memory_order_relaxed);
+    uint32_t rawArg = (uint32_t)slot.arg.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != n + 1) continue; // overwritten meanwhile
+
+    int type = (int)(data >> 56);
+    int thread = (int)((data >> 48) & 0xFF);
+    int arg = (int32_t)rawArg;
+    uint32_t value = (uint32_t)data;
+    if (type >= kNumFlightEventTypes) continue;
+
+    // timed events are recorded when they end
+    bool timed = type == kFlightMidiReinit || type == kFlightMidiInit || type == kFlightReconcile;
+    double ts = time / 1000.;
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,", written++ ? "," : "", eventNames[type], pid, thread);
+    if (timed) fprintf(fp, "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%u,", ts - value, value);
+    else fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,", ts);
+    if (type == kFlightMidiInit) {
+      int input = rawArg >> 16, output = rawArg & 0xFFFF;
+      fprintf(fp, "\"args\":{\"input\":%d,\"output\":%d}}", input == 0xFFFF ? -1 : input, output == 0xFFFF ? -1 : output);
+    }
+    else if (type == kFlightHotplugArrived) {
+      fprintf(fp, "\"args\":{\"bus\":%u,\"address\":%u,\"inputs\":%u,\"outputs\":%u}}", (rawArg >> 8) & 0xFF, rawArg & 0xFF, value >> 16, value & 0xFFFF);
+    }
+    else if (type == kFlightHotplugLeft) {
+      fprintf(fp, "\"args\":{\"bus\":%u,\"address\":%u}}", (rawArg >> 8) & 0xFF, rawArg & 0xFF);
+    }
+    else {
+      fprintf(fp, "\"args\":{\"arg\":%d}}", arg);
+    }
+  }
+  return written;
+}
+
+// Write the flight recorder as Chrome/Perfetto trace-event JSON to
+// <resource path>/automidireset-trace.json (chrome://tracing, ui.perfetto.dev),
+// with the ring of the previous session as a second process if there is one.
+bool dumpTrace(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd)
+{
+  if (command != traceCommandId) return false;
+  if (!g_flight.header || !GetResourcePath) return true;
+
+  std::string path = std::string(GetResourcePath()) + "/automidireset-trace.json";
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    ShowConsoleMsg("automidireset: couldn't write the trace file\n");
+    return true;
+  }
+
+  fputs("{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"this session\"}}", fp);
+  int written = writeTraceEvents(fp, g_flight.header, g_flight.slots, 1, 1) - 1;
+  int previous = 0;
+#ifndef WIN32
+  size_t prevSize;
+  if (const FlightRecorderHeader *prev = mapFlightFile(std::string(GetResourcePath()) + "/automidireset-flight.prev.bin", &prevSize)) {
+    fputs(",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"previous session\"}}", fp);
+    previous = writeTraceEvents(fp, prev, (const FlightSlot *)(prev + 1), 2, 1) - 1;
+    munmap((void *)prev, prevSize);
+  }
+#endif
+  fputs("\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"source\":\"reaper_automidireset\"}}\n", fp);
+  fclose(fp);
+
+  char cslMsg[600];
+  snprintf(cslMsg, sizeof(cslMsg), "automidireset: wrote %d events (%d from the previous session) to %s\n",
+           written + previous, previous, path.c_str());
+  ShowConsoleMsg(cslMsg);
+  return true;
+}
+
+static NameGlob compileGlob(const std::string &pattern)
+{
+  NameGlob glob;
+  glob.anchoredStart = pattern.empty() || pattern.front() != '*';
+  glob.anchoredEnd = pattern.empty() || pattern.back() != '*';
+  size_t pos = 0;
+  while (pos <= pattern.size()) {
+    size_t star = pattern.find('*', pos);
+    if (star == std::string::npos) star = pattern.size();
+    if (star > pos) glob.segments.push_back(pattern.substr(pos, star - pos));
+    pos = star + 1;
+  }
+  return glob;
+}
+
+static inline bool segmentMatches(const char *str, const std::string &segment)
+{
+  for (size_t i = 0; i < segment.size(); ++i) {
+    if (segment[i] != '?' && segment[i] != str[i]) return false;
+  }
+  return true;
+}
+
+static bool globMatches(const NameGlob &glob, const char *str)
+{
+  size_t len = strlen(str);
+  size_t first = 0, last = glob.segments.size();
+
+  if (!last) return !glob.anchoredStart || !len; // "*" or ""
+  if (glob.anchoredStart) {
+    const std::string &seg = glob.segments[first++];
+    if (seg.size() > len || !segmentMatches(str, seg)) return false;
+    str += seg.size();
+    len -= seg.size();
+    if (first == glob.segments.size()) return !glob.anchoredEnd || !len;
+  }
+  if (glob.anchoredEnd) {
+    const std::string &seg = glob.segments[--last];
+    if (seg.size() > len || !segmentMatches(str + len - seg.size(), seg)) return false;
+    len -= seg.size();
+  }
+  // unanchored segments in between: leftmost match is always good enough
+  for (size_t i = first; i < last; ++i) {
+    const std::string &seg = glob.segments[i];
+    bool found = false;
+    while (seg.size() <= len) {
+      if (segmentMatches(str, seg)) {
+        found = true;
+        break;
+      }
+      ++str;
+      --len;
+    }
+    if (!found) return false;
+    str += seg.size();
+    len -= seg.size();
+  }
+  return true;
+}
+
+static bool parseRule(const char *verb, const char *kind, const char *value)
+{
+  if (!strcmp(verb, "priority")) {
+    static const char * const classes[] = { "clock", "surface", "high" };
+    for (int i = 0; i < 3; ++i) {
+      if (!strcmp(kind, classes[i])) {
+        g_rules.priorityNames.push_back(std::make_pair(compileGlob(value), kPriorityClock + i));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool include = !strcmp(verb, "include");
+  if (!include && strcmp(verb, "exclude")) return false;
+
+  if (!strcmp(kind, "usb")) {
+    unsigned int vid, pid = 0xFFFF;
+    char pidStr[8];
+    if (sscanf(value, "%x:%7s", &vid, pidStr) != 2 || vid > 0xFFFF) return false;
+    if (strcmp(pidStr, "*") && (sscanf(pidStr, "%x", &pid) != 1 || pid > 0xFFFE)) return false;
+    (include ? g_rules.includeUsb : g_rules.excludeUsb).insert((vid << 16) | pid);
+  }
+  else if (!strcmp(kind, "path")) {
+    (include ? g_rules.includePaths : g_rules.excludePaths).insert(value);
+  }
+  else if (!strcmp(kind, "name")) {
+    (include ? g_rules.includeNames : g_rules.excludeNames).push_back(compileGlob(value));
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+static double getSetting(const char *key, double defaultValue)
+{
+  if (!GetExtState) return defaultValue;
+
+  const char *value = GetExtState(EXTSTATE_SECTION, key);
+  return value && *value ? atof(value) : defaultValue;
+}
+
+void loadConfig()
+{
+  g_settings.sliceBudgetMs = getSetting("slice_budget_ms", 2.);
+  g_settings.pairPorts = getSetting("pair_ports", 1.) != 0.;
+  g_settings.deferPolicy = (int)getSetting("defer_reinit", 0.);
+  g_settings.maxDeferMs = getSetting("max_defer_ms", 60000.);
+  g_settings.quarantineMs = getSetting("quarantine_ms", 0.);
+  g_settings.stallThresholdMs = getSetting("stall_threshold_ms", 20.);
+  g_settings.metricsIntervalS = getSetting("metrics_interval_s", 0.);
+  g_settings.maxPlaybackReinitMs = getSetting("max_playback_reinit_ms", 0.);
+  g_settings.shadowMode = (int)getSetting("shadow_mode", 0.);
+  g_settings.sweepMaxIntervalS = getSetting("sweep_max_interval_s", 60.);
+  g_settings.dedupWindowMs = getSetting("dedup_window_ms", 2000.);
+  g_settings.broker = (int)getSetting("broker", 0.);
+  g_settings.servicePolicy = (int)getSetting("service_policy", 0.);
+  g_settings.serviceCpus = (uint64_t)getSetting("service_cpus", 0.);
+  openFlightRecorder();
+  loadRules();
+  loadOpenCosts();
+  loadBenchmark();
+}
+
+void loadRules()
+{
+  g_rules = DeviceRules();
+  if (!GetResourcePath) return;
+
+  std::string path = std::string(GetResourcePath()) + "/automidireset-rules.txt";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) return;
+
+  char line[512];
+  int lineNum = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    ++lineNum;
+    char verb[16], kind[16], value[400];
+    if (line[0] == '#' || sscanf(line, " %15s %15s %399[^\r\n]", verb, kind, value) != 3) continue;
+
+    if (!parseRule(verb, kind, value)) {
+      char cslMsg[600];
+      snprintf(cslMsg, sizeof(cslMsg), "automidireset: ignoring rule on line %d of %s\n", lineNum, path.c_str());
+      ShowConsoleMsg(cslMsg);
+    }
+  }
+  fclose(fp);
+}
+
+static inline bool usbRuleMatches(const std::unordered_set<uint32_t> &rules, uint16_t vid, uint16_t pid)
+{
+  return rules.count(((uint32_t)vid << 16) | pid) || rules.count(((uint32_t)vid << 16) | 0xFFFF);
+}
+
+// the usb rules alone, where there is no bus path (Windows)
+bool usbIdAllowed(uint16_t vid, uint16_t pid)
+{
+  if (!g_rules.includeUsb.empty() && !usbRuleMatches(g_rules.includeUsb, vid, pid)) return false;
+  return !usbRuleMatches(g_rules.excludeUsb, vid, pid);
+}
+
+bool usbDeviceAllowed(uint16_t vid, uint16_t pid, const char *path)
+{
+  if (!usbIdAllowed(vid, pid)) return false;
+  if (!g_rules.includePaths.empty() && !g_rules.includePaths.count(path)) return false;
+  return !g_rules.excludePaths.count(path);
+}
+
+bool portNameAllowed(const char *name)
+{
+  if (!g_rules.includeNames.empty()) {
+    bool included = false;
+    for (const NameGlob &glob : g_rules.includeNames) {
+      if (globMatches(glob, name)) {
+        included = true;
+        break;
+      }
+    }
+    if (!included) return false;
+  }
+  for (const NameGlob &glob : g_rules.excludeNames) {
+    if (globMatches(glob, name)) return false;
+  }
+  return true;
+}
+
+void watchBegin(int invocation)
+{
+  g_watch.active = true;
+  g_watch.current.invocation = invocation;
+  g_watch.current.numEntries = 0;
+  g_watch.current.dropped = 0;
+  g_watch.started = std::chrono::steady_clock::now();
+}
+
+void watchEnd()
+{
+  if (!g_watch.active) return;
+
+  g_watch.active = false;
+  uint32_t us = usSince(g_watch.started, std::chrono::steady_clock::now());
+  int bucket = 0;
+  while ((us >> bucket) > 1 && bucket < WATCH_HISTOGRAM_BUCKETS - 1) ++bucket;
+  ++g_watchStats.histogram[g_watch.current.invocation][bucket];
+  g_watchStats.totalUs[g_watch.current.invocation] += us;
+
+  if (us >= g_settings.stallThresholdMs * 1000.) {
+    ++g_watchStats.stalls;
+    g_watch.current.totalMs = us / 1000.;
+    g_watchStats.lastStall = g_watch.current;
+  }
+}
+
+static void initLists()
+{
+  if (!midi_init) return;
+
+  char portName[512];
+  inputsList.clear();
+  outputsList.clear();
+  g_portNames[0].clear();
+  g_portNames[1].clear();
+  int numMIDIInputs;
+  {
+    WatchScope watch(kStagePortCount);
+    numMIDIInputs = GetNumMIDIInputs();
+  }
+  for (int i = 0; i < numMIDIInputs; i++) {
+    WatchScope watch(kStagePortName, i);
+    portName[0] = '\0';
+    bool inputAttached = GetMIDIInputName(i, portName, 512);
+    inputsList.push_back(inputAttached);
+    g_portNames[0].push_back(portName);
+    // char cslMsg[512];
+    // snprintf(cslMsg, 512, "MIDI Init INPUT %d %s (%d)\n", i, portName, inputAttached);
+    // ShowConsoleMsg(cslMsg);
+  }
+  int numMIDIOutputs;
+  {
+    WatchScope watch(kStagePortCount);
+    numMIDIOutputs = GetNumMIDIOutputs();
+  }
+  for (int i = 0; i < numMIDIOutputs; i++) {
+    WatchScope watch(kStagePortName, i);
+    portName[0] = '\0';
     bool outputAttached = GetMIDIOutputName(i, portName, 512);
     outputsList.push_back(outputAttached);
+    g_portNames[1].push_back(portName);
+    // char cslMsg[512];
+    // snprintf(cslMsg, 512, "MIDI Init OUTPUT %d %s (%d)\n", i, portName, outputAttached);
+    // ShowConsoleMsg(cslMsg);
+  }
+  inputsInUse = inputsList;
+  outputsInUse = outputsList;
+  publishPortTable();
+  publishStatus();
+#ifndef __linux__
+  // the lists match the OS now; without this the first sweep sees a change
+  g_sweep.reconciled = osDeviceFingerprint();
+#endif
+}
+
+// Copy inputsList/outputsList and the names into a spare snapshot slot and
+// make it current. Owner of the lists only.
+void publishPortTable()
+{
+  const int current = g_portTable.current.load(std::memory_order_relaxed);
+  const std::vector<bool> *lists[2] = { &inputsList, &outputsList };
+
+  // keep the generation for scripts meaningful: only publish changes
+  bool changed = !g_portTable.generation;
+  const PortSnapshot &previous = g_portTable.slots[current];
+  for (int output = 0; output < 2 && !changed; ++output) {
+    const std::vector<bool> &list = *lists[output];
+    const std::vector<std::string> &names = g_portNames[output];
+    const std::vector<uint32_t> &reinits = g_portReinits[output];
+    changed = previous.ports[output].size() != list.size();
+    for (size_t i = 0; i < list.size() && !changed; ++i) {
+      changed = previous.ports[output][i].attached != list[i]
+        || previous.ports[output][i].name != (i < names.size() ? names[i] : std::string())
+        || previous.ports[output][i].reinits != (i < reinits.size() ? reinits[i] : 0);
+    }
+  }
+  if (!changed) {
+    g_portTable.dirty = false;
+    return;
+  }
+
+  int slot = -1;
+  for (int i = 1; i < PORT_TABLE_SLOTS && slot < 0; ++i) {
+    int candidate = (current + i) % PORT_TABLE_SLOTS;
+    if (!g_portTable.readers[candidate].load()) slot = candidate; // pairs with the reader's recheck
+  }
+  if (slot < 0) {
+    g_portTable.dirty = true;
+    ++g_portTable.skipped;
+    return;
+  }
+
+  PortSnapshot &snapshot = g_portTable.slots[slot];
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<bool> &list = *lists[output];
+    std::vector<std::string> &names = g_portNames[output];
+    std::vector<uint32_t> &reinits = g_portReinits[output];
+    names.resize(list.size());
+    reinits.resize(list.size(), 0);
+    snapshot.ports[output].resize(list.size());
+    for (size_t i = 0; i < list.size(); ++i) {
+      snapshot.ports[output][i].name = names[i];
+      snapshot.ports[output][i].attached = list[i];
+      snapshot.ports[output][i].reinits = reinits[i];
+    }
+  }
+  snapshot.generation = ++g_portTable.generation;
+  snapshot.published = std::chrono::steady_clock::now();
+  g_portTable.current.store(slot);
+  g_portTable.dirty = false;
+}
+
+static inline bool learnedFlag(const std::vector<bool> &flags, int index)
+{
+  return index < (int)flags.size() && flags[index];
+}
+
+int portPriority(const PortRef &port, const char *name)
+{
+  int priority = kPriorityOther;
+  for (const auto &rule : g_rules.priorityNames) {
+    if (rule.second < priority && globMatches(rule.first, name)) priority = rule.second;
+  }
+  if (port.output) {
+    if (learnedFlag(clockOutputs, port.index)) priority = std::min(priority, (int)kPriorityClock);
+    if (learnedFlag(surfaceOutputs, port.index)) priority = std::min(priority, (int)kPrioritySurface);
+    if (learnedFlag(outputsInUse, port.index)) priority = std::min(priority, (int)kPriorityInUse);
+  }
+  else {
+    if (learnedFlag(surfaceInputs, port.index)) priority = std::min(priority, (int)kPrioritySurface);
+    if (port.index < (int)inputTraffic.size() && inputTraffic[port.index] > 100) { // more than incidental use
+      priority = std::min(priority, (int)kPriorityHigh);
+    }
+    if (learnedFlag(inputsInUse, port.index)) priority = std::min(priority, (int)kPriorityInUse);
+  }
+  return priority;
+}
+
+// Pick the clock outputs and control surface ports out of reaper.ini. Best
+// effort: midiouts_clock is the bitmask of outputs sending clock, and the
+// MIDI-based surfaces are stored as "csurf_N=<type> <flags> <config>", where
+// the config of MCU, MCUEX and HUI is "<offset> <size> <indev> <outdev> ..."
+// (see parseParms() in the SDK's csurf sources), -1 meaning no device.
+void learnPriorities()
+{
+  clockOutputs.clear();
+  surfaceInputs.clear();
+  surfaceOutputs.clear();
+  if (!get_ini_file) return;
+
+  FILE *fp = fopen(get_ini_file(), "r");
+  if (!fp) return;
+
+  auto setFlag = [](std::vector<bool> &flags, int index) {
+    if (index < 0 || index >= 1024) return;
+    if (index >= (int)flags.size()) flags.resize(index + 1, false);
+    flags[index] = true;
+  };
+
+  char line[1024];
+  bool inMainSection = false;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '[') {
+      inMainSection = !strncmp(line, "[REAPER]", 8);
+      continue;
+    }
+    if (!inMainSection) continue;
+
+    if (!strncmp(line, "midiouts_clock=", 15)) {
+      unsigned long long mask = strtoull(line + 15, NULL, 0);
+      for (int i = 0; i < 64; ++i) {
+        if (mask & (1ull << i)) setFlag(clockOutputs, i);
+      }
+    }
+    else if (!strncmp(line, "csurf_", 6) && isdigit((unsigned char)line[6])) {
+      char type[16];
+      int flags, offset, size, input, output;
+      const char *params = strchr(line, '=');
+      if (params && sscanf(params + 1, "%15s %d %d %d %d %d", type, &flags, &offset, &size, &input, &output) == 6
+          && (!strcmp(type, "MCU") || !strcmp(type, "MCUEX") || !strcmp(type, "HUI")))
+      {
+        setFlag(surfaceInputs, input);
+        setFlag(surfaceOutputs, output);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+// Count recent input events per device, to find the busy inputs.
+void sampleTraffic()
+{
+  if (!MIDI_GetRecentInputEvent) return;
+
+  WatchScope watch(kStageTraffic);
+  int newestSeq = 0;
+  for (int idx = 0; idx < 256; ++idx) {
+    char buf[4];
+    int bufSize = sizeof(buf), ts = 0, devIdx = -1;
+    int seq = MIDI_GetRecentInputEvent(idx, buf, &bufSize, &ts, &devIdx, NULL, NULL);
+    if (!seq || seq <= g_lastTrafficSeq) break;
+    if (!idx) newestSeq = seq;
+
+    devIdx &= 0xFFFF;
+    if (devIdx < 1024) {
+      if (devIdx >= (int)inputTraffic.size()) inputTraffic.resize(devIdx + 1, 0);
+      ++inputTraffic[devIdx];
+    }
+  }
+  if (newestSeq) g_lastTrafficSeq = newestSeq;
+}
+
+// Port name with the direction taken out, so that both halves of a device
+// compare equal: "MIDIIN2 (Launchpad X)" and "MIDIOUT2 (Launchpad X)" become
+// "midi2 launchpad x", "MIDISPORT 2x2 In A" and "... Out A" "midisport 2x2 a".
+static std::string portNameStem(const char *name)
+{
+  std::string stem, word;
+  for (const char *p = name; ; ++p) {
+    if (*p && isalnum((unsigned char)*p)) {
+      word += (char)tolower((unsigned char)*p);
+      continue;
+    }
+    if (!word.empty() && word != "in" && word != "out" && word != "input" && word != "output") {
+      if (!word.compare(0, 6, "midiin")) word.erase(4, 2);
+      else if (!word.compare(0, 7, "midiout")) word.erase(4, 3);
+      if (!stem.empty()) stem += ' ';
+      stem += word;
+    }
+    word.clear();
+    if (!*p) break;
+  }
+  return stem;
+}
+
+void loadOpenCosts()
+{
+  g_openCosts.clear();
+  if (!GetResourcePath) return;
+
+  std::string path = std::string(GetResourcePath()) + "/automidireset-profile.txt";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) return;
+
+  char line[600];
+  while (fgets(line, sizeof(line), fp)) {
+    OpenCost cost;
+    char stem[512];
+    if (sscanf(line, "%lf %lf %d %511[^\r\n]", &cost.avgMs, &cost.maxMs, &cost.count, stem) == 4) {
+      g_openCosts[stem] = cost;
+    }
+  }
+  fclose(fp);
+}
+
+// Move a fully written temporary file over path, so that readers never
+// see a partial one.
+static void replaceFile(const std::string &tmpPath, const std::string &path)
+{
+#ifdef WIN32
+  MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  rename(tmpPath.c_str(), path.c_str());
+#endif
+}
+
+// Only once a midi_init of a present device has changed the profile.
+void saveOpenCosts()
+{
+  if (!g_openCostsDirty || !GetResourcePath) return;
+
+  WatchScope watch(kStageProfile);
+  std::string path = std::string(GetResourcePath()) + "/automidireset-profile.txt";
+  std::string tmpPath = path + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (!fp) return;
+
+  for (const auto &entry : g_openCosts) {
+    fprintf(fp, "%.3f %.3f %d %s\n", entry.second.avgMs, entry.second.maxMs, entry.second.count, entry.first.c_str());
+  }
+  fclose(fp);
+  replaceFile(tmpPath, path);
+  g_openCostsDirty = false;
+}
+
+void timedMidiInit(int input, int output, const std::string &stem)
+{
+  const auto start = std::chrono::steady_clock::now();
+  {
+    WatchScope watch(kStageMidiInit, input >= 0 ? input : output);
+    midi_init(input, output);
+  }
+  double ms = elapsedMs(start);
+  flightRecord(kFlightMidiInit, FLIGHT_REAPER_THREAD, ((input >= 0 ? input & 0xFFFF : 0xFFFF) << 16) | (output >= 0 ? output & 0xFFFF : 0xFFFF), (uint32_t)(ms * 1000.));
+
+  if (stem.empty()) return;
+  OpenCost &cost = g_openCosts[stem];
+  cost.avgMs = cost.count ? cost.avgMs + OPEN_COST_WEIGHT * (ms - cost.avgMs) : ms;
+  cost.maxMs = std::max(cost.maxMs, ms);
+  ++cost.count;
+  g_openCostsDirty = true;
+}
+
+bool quarantined(const std::string &stem)
+{
+  if (g_settings.quarantineMs <= 0.) return false;
+
+  auto it = g_openCosts.find(stem);
+  return it != g_openCosts.end() && it->second.count >= QUARANTINE_MIN_SAMPLES
+    && it->second.avgMs >= g_settings.quarantineMs;
+}
+
+static inline bool portAttached(const PortRef &port, char *name, int nameSize)
+{
+  WatchScope watch(kStagePortName, port.index);
+  return port.output ? GetMIDIOutputName(port.index, name, nameSize) : GetMIDIInputName(port.index, name, nameSize);
+}
+
+// Start reconciling the port lists with REAPER's, usually after midi_reinit().
+// Work is done by reconcileStep(), possibly spread over several calls.
+static void beginReconcile(bool attachOnly, bool reinited)
+{
+  if (!midi_init) return;
+
+  g_reconcile.active = true;
+  g_reconcile.attachOnly = attachOnly;
+  g_reconcile.reinited = reinited;
+  g_reconcile.reinitIfIdle = false;
+  ++g_reconcile.generation;
+  ++(reinited ? g_metrics.fullReinits : g_metrics.targetedReinits);
+  g_reconcile.scanned = PortRef { 0, false };
+  g_reconcile.pending.clear();
+  g_reconcile.nextPending = 0;
+  g_reconcile.ticks = 0;
+  g_reconcile.calls = 0;
+  g_reconcile.started = std::chrono::steady_clock::now();
+  g_reconcile.workMs = 0.;
+  g_reconcile.unattached.clear();
+  g_reconcile.numPorts[0] = (int)inputsList.size();
+  g_reconcile.numPorts[1] = (int)outputsList.size();
+  g_verify.active = false; // this reconcile supersedes the previous verification
+
+  {
+    WatchScope watch(kStagePortCount);
+    inputsList.resize(GetNumMIDIInputs(), false);
+    outputsList.resize(GetNumMIDIOutputs(), false);
+  }
+  inputsInUse.resize(inputsList.size(), false);
+  outputsInUse.resize(outputsList.size(), false);
+  if (!attachOnly) {
+    WatchScope watch(kStageReaperIni);
+    learnPriorities();
+  }
+}
+
+// Scan the ports for attachment changes, then midi_init() the changed ones
+// in PortPriority order. Returns once finished or once budgetMs is spent
+// (a negative budget means no limit); true when finished.
+static bool reconcileStep(double budgetMs)
+{
+  if (!g_reconcile.active) return true;
+
+  const auto sliceStart = std::chrono::steady_clock::now();
+  ++g_reconcile.ticks;
+
+  PortRef &port = g_reconcile.scanned;
+  while (!port.output || port.index < (int)outputsList.size()) {
+    if (!port.output && port.index >= (int)inputsList.size()) {
+      port = PortRef { 0, true };
+      continue;
+    }
+    std::vector<bool> &list = port.output ? outputsList : inputsList;
+    char portName[512] = "";
+    bool attached = portAttached(port, portName, 512);
+    std::vector<std::string> &names = g_portNames[port.output ? 1 : 0];
+    if ((int)names.size() <= port.index) names.resize(port.index + 1);
+    names[port.index] = portName;
+    if (*portName && list[port.index] != attached && (attached || !g_reconcile.attachOnly) && portNameAllowed(portName)) {
+      g_reconcile.pending.push_back(PendingPort { port, portPriority(port, portName), portNameStem(portName), attached, false });
+    }
+    // a slot midi_reinit just added for an arriving device, but detached:
+    // maybe still binding. Known slots that are detached are removals.
+    if (*portName && !attached && !g_reconcile.attachOnly
+        && port.index >= g_reconcile.numPorts[port.output ? 1 : 0] && portNameAllowed(portName))
+    {
+      g_reconcile.unattached.push_back(port);
+    }
+    ++port.index;
+    if (budgetMs >= 0 && elapsedMs(sliceStart) >= budgetMs) {
+      g_reconcile.workMs += elapsedMs(sliceStart);
+      return false;
+    }
+  }
+
+  if (!g_reconcile.nextPending) {
+    // stable, so inputs stay ahead of outputs within each class
+    std::stable_sort(g_reconcile.pending.begin(), g_reconcile.pending.end(), [](const PendingPort &a, const PendingPort &b) {
+      return a.priority < b.priority;
+    });
+  }
+
+  while (g_reconcile.nextPending < g_reconcile.pending.size()) {
+    PendingPort &pending = g_reconcile.pending[g_reconcile.nextPending++];
+    if (pending.done) continue;
+
+    // the other direction of the same device, if it's waiting as well
+    PendingPort *partner = NULL;
+    if (g_settings.pairPorts && !pending.stem.empty()) {
+      for (size_t i = g_reconcile.nextPending; i < g_reconcile.pending.size(); ++i) {
+        PendingPort &candidate = g_reconcile.pending[i];
+        if (!candidate.done && candidate.port.output != pending.port.output && candidate.stem == pending.stem) {
+          partner = &candidate;
+          break;
+        }
+      }
+    }
+
+    PendingPort *ports[2] = { &pending, partner };
+    int initIndex[2] = { -1, -1 }; // input, output
+    for (PendingPort *port : ports) {
+      if (port) initIndex[port->port.output ? 1 : 0] = port->port.index;
+    }
     // char cslMsg[512];
-    // snprintf(cslMsg, 512, "MIDI Init OUTPUT %d %s (%d)\n", i, portName, outputAttached);
+    // snprintf(cslMsg, 512, "MIDI Init %d, %d\n", initIndex[0], initIndex[1]);
     // ShowConsoleMsg(cslMsg);
+    // closing a port of a removed device says nothing about its open cost
+    const bool present = pending.attaching || (partner && partner->attaching);
+    timedMidiInit(initIndex[0], initIndex[1], present ? pending.stem : std::string());
+    ++g_reconcile.calls;
+
+    double readyMs = elapsedMs(g_reconcile.started);
+    for (PendingPort *port : ports) {
+      if (!port) continue;
+      const PortRef &next = port->port;
+      char portName[512] = "";
+      bool attached = portAttached(next, portName, 512);
+      (next.output ? outputsList : inputsList)[next.index] = attached;
+      if (attached) (next.output ? outputsInUse : inputsInUse)[next.index] = true;
+      else if (port->attaching) g_reconcile.unattached.push_back(next); // dropped again in midi_init
+      if (attached && !g_reconcile.reinited) countReinit(next);
+      if (attached && g_reconcile.attachOnly) g_defer.targeted.push_back(next);
+      port->done = true;
+      ++g_readyStats[port->priority].count;
+      g_readyStats[port->priority].lastMs = readyMs;
+      g_readyStats[port->priority].totalMs += readyMs;
+    }
+    if (budgetMs >= 0 && elapsedMs(sliceStart) >= budgetMs) {
+      g_reconcile.workMs += elapsedMs(sliceStart);
+      return false;
+    }
+  }
+
+  if (g_reconcile.reinitIfIdle && g_reconcile.pending.empty()) {
+    fullReinit(); // nothing changed in the known slots: a new device, which only midi_reinit adds
+    return false;
+  }
+
+  g_reconcile.active = false;
+  g_reconcile.workMs += elapsedMs(sliceStart);
+  ++g_reconcileStats.count;
+  g_reconcileStats.lastTicks = g_reconcile.ticks;
+  g_reconcileStats.maxTicks = std::max(g_reconcileStats.maxTicks, g_reconcile.ticks);
+  g_reconcileStats.lastPorts = (int)g_reconcile.pending.size();
+  g_reconcileStats.lastCalls = g_reconcile.calls;
+  g_reconcileStats.totalPorts += g_reconcileStats.lastPorts;
+  g_reconcileStats.totalCalls += g_reconcile.calls;
+  g_reconcileStats.lastMs = elapsedMs(g_reconcile.started);
+  flightRecord(kFlightReconcile, FLIGHT_REAPER_THREAD, g_reconcileStats.lastPorts, (uint32_t)(g_reconcileStats.lastMs * 1000.));
+  saveOpenCosts();
+  if (g_reconcile.reinited) {
+    shadowCompare();
+    // midi_reinit reopened everything that is attached now
+    for (int output = 0; output < 2; ++output) {
+      const std::vector<bool> &list = output ? outputsList : inputsList;
+      for (int i = 0; i < (int)list.size(); ++i) {
+        if (list[i]) countReinit(PortRef { i, output != 0 });
+      }
+    }
   }
+  publishPortTable();
+  publishStatus();
+#ifndef __linux__
+  g_sweep.reconciled = osDeviceFingerprint();
+  g_sweep.schedule.activity();
+#endif
+  beginVerify();
+  return true;
 }
 
-static void updateLists()
+void beginVerify()
 {
-  if (!midi_init) return;
+  g_verify.ports.clear();
+  for (const PortRef &port : g_reconcile.unattached) {
+    g_verify.ports.push_back(RetryPort { port, 0 });
+  }
+  g_verify.active = !g_verify.ports.empty();
+  g_verify.round = 0;
+  g_verify.started = g_reconcile.started;
+  g_verify.next = std::chrono::steady_clock::now() + std::chrono::milliseconds(VERIFY_FIRST_DELAY_MS);
+}
 
-  int numMIDIInputs = GetNumMIDIInputs();
-  for (int i = 0; i < numMIDIInputs; i++) {
-    char inputName[512] = "";
-    bool inputAttached = GetMIDIInputName(i, inputName, 512);
-    if (*inputName && inputsList[i] != inputAttached) {
-      // char cslMsg[512];
-      // snprintf(cslMsg, 512, "MIDI Init INPUT %d %s (was %d, now %d)\n", i, inputName, inputsList[i] ? 1 : 0, inputAttached);
-      // ShowConsoleMsg(cslMsg);
-      midi_init(i, -1);
-      inputsList[i] = inputAttached;
+static void recordVerifyResult(const RetryPort &retry, const char *name, double attachedMs)
+{
+  if (g_verifyResults.size() >= MAX_VERIFY_RESULTS) g_verifyResults.erase(g_verifyResults.begin());
+  g_verifyResults.push_back(VerifyResult { name, retry.port.output, retry.retries, attachedMs });
+}
+
+// Re-check the ports from beginVerify(), and midi_init the ones that are
+// still detached. Returns the delay in ms until the next round, or -1 once
+// every port attached or ran out of retries.
+int verifyStep()
+{
+  if (!g_verify.active) return -1;
+
+  size_t remaining = 0;
+  bool attachedLate = false;
+  for (RetryPort &retry : g_verify.ports) {
+    const PortRef &port = retry.port;
+    char portName[512] = "";
+    bool attached = portAttached(port, portName, 512);
+    std::vector<bool> &list = port.output ? outputsList : inputsList;
+    std::string stem = portNameStem(portName);
+
+    if (attached) {
+      if (!list[port.index]) {
+        // it came up after the reconcile, so REAPER hasn't opened it yet
+        timedMidiInit(port.output ? -1 : port.index, port.output ? port.index : -1, stem);
+        list[port.index] = true;
+        (port.output ? outputsInUse : inputsInUse)[port.index] = true;
+        g_portNames[port.output ? 1 : 0][port.index] = portName;
+        countReinit(port); // as the reconcile would have, so subscribers see it reopened
+        attachedLate = true;
+      }
+      ++g_verifyStats.lateAttached;
+      recordVerifyResult(retry, portName, elapsedMs(g_verify.started));
+    }
+    else if (retry.retries >= VERIFY_MAX_RETRIES || quarantined(stem)) {
+      ++g_verifyStats.failed;
+      recordVerifyResult(retry, portName, -1.);
+    }
+    else {
+      ++retry.retries;
+      timedMidiInit(port.output ? -1 : port.index, port.output ? port.index : -1, std::string()); // absent, so not the device's cost
+      g_verify.ports[remaining++] = retry;
     }
   }
-  int numMIDIOutputs = GetNumMIDIOutputs();
-  for (int i = 0; i < numMIDIOutputs; i++) {
-    char outputName[512] = "";
-    bool outputAttached = GetMIDIOutputName(i, outputName, 512);
-    if (*outputName && outputsList[i] != outputAttached) {
-      // char cslMsg[512];
-      // snprintf(cslMsg, 512, "MIDI Init OUTPUT %d %s (was %d, now %d)\n", i, outputName, outputsList[i] ? 1 : 0, outputAttached);
-      // ShowConsoleMsg(cslMsg);
-      midi_init(-1, i);
-      outputsList[i] = outputAttached;
+  g_verify.ports.resize(remaining);
+  if (attachedLate) publishPortTable();
+  flightRecord(kFlightVerify, FLIGHT_REAPER_THREAD, (int)remaining);
+  saveOpenCosts();
+  if (!remaining) {
+    g_verify.active = false;
+    return -1;
+  }
+
+  int delayMs = VERIFY_FIRST_DELAY_MS << ++g_verify.round;
+  g_verify.next = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+  return delayMs;
+}
+
+static BenchTiming benchTiming(std::vector<double> &samples)
+{
+  std::sort(samples.begin(), samples.end());
+  return BenchTiming { samples.front(), samples[samples.size() / 2], samples.back() };
+}
+
+static void printBenchTiming(FILE *fp, std::string &out, const char *what, const BenchTiming &timing)
+{
+  char line[600];
+  snprintf(line, sizeof(line), "%s %.3f %.3f %.3f\n", what, timing.minMs, timing.medianMs, timing.maxMs);
+  out += line;
+  if (fp) fputs(line, fp);
+}
+
+void loadBenchmark()
+{
+  g_benchReinitMs = -1.;
+  if (!GetResourcePath) return;
+
+  std::string path = std::string(GetResourcePath()) + "/automidireset-bench.txt";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) return;
+
+  char line[600];
+  BenchTiming timing;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "midi_reinit %lf %lf %lf", &timing.minMs, &timing.medianMs, &timing.maxMs) == 3) {
+      g_benchReinitMs = timing.medianMs;
+    }
+  }
+  fclose(fp);
+}
+
+// Measure midi_reinit, midi_init of each present port and a full port name
+// scan on this system. Blocks REAPER while it runs, so it's only allowed
+// with the transport stopped and nothing else in progress. Runs where the
+// reconcile state lives (the window thread on Windows), see runBenchmark().
+// Ends with a full reconcile, as after any midi_reinit, which the caller's
+// thread steps as usual.
+static void benchmark(std::string &out)
+{
+  if ((GetPlayState && GetPlayState()) || g_reconcile.active || g_verify.active) {
+    out += "automidireset: stop the transport and wait for device changes to settle before benchmarking\n";
+    return;
+  }
+
+  std::string path = std::string(GetResourcePath()) + "/automidireset-bench.txt";
+  FILE *fp = fopen(path.c_str(), "w");
+  out += "automidireset benchmark (ms: min median max)\n";
+
+  // measured once at startup, kept here so that builds can be compared
+  printBenchTiming(fp, out, "plugin_load", BenchTiming { g_pluginLoadMs, g_pluginLoadMs, g_pluginLoadMs });
+#ifdef __linux__
+  const double usbLoadMs = g_usbLoadMs.load(std::memory_order_relaxed);
+  if (usbLoadMs >= 0.) {
+    printBenchTiming(fp, out, "libusb_load", BenchTiming { usbLoadMs, usbLoadMs, usbLoadMs });
+  }
+#endif
+  // publish to subscriber callback, over the last notifications
+  if (g_benchNotifyValid) printBenchTiming(fp, out, "notify_latency", g_benchNotify);
+
+  std::vector<double> samples;
+  for (int i = 0; i < BENCH_REINIT_RUNS; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    midi_reinit();
+    samples.push_back(elapsedMs(start));
+  }
+  BenchTiming reinit = benchTiming(samples);
+  printBenchTiming(fp, out, "midi_reinit", reinit);
+  g_benchReinitMs = reinit.medianMs;
+
+  samples.clear();
+  for (int i = 0; i < BENCH_SCAN_RUNS; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    char portName[512];
+    int numInputs = GetNumMIDIInputs(), numOutputs = GetNumMIDIOutputs();
+    for (int j = 0; j < numInputs; ++j) GetMIDIInputName(j, portName, 512);
+    for (int j = 0; j < numOutputs; ++j) GetMIDIOutputName(j, portName, 512);
+    samples.push_back(elapsedMs(start));
+  }
+  printBenchTiming(fp, out, "scan", benchTiming(samples));
+
+  for (int output = 0; output < 2; ++output) {
+    int numPorts = output ? GetNumMIDIOutputs() : GetNumMIDIInputs();
+    for (int i = 0; i < numPorts; ++i) {
+      char portName[512] = "";
+      if (!portAttached(PortRef { i, output != 0 }, portName, 512)) continue;
+
+      std::string stem = portNameStem(portName);
+      samples.clear();
+      for (int j = 0; j < BENCH_INIT_RUNS; ++j) {
+        const auto start = std::chrono::steady_clock::now();
+        timedMidiInit(output ? -1 : i, output ? i : -1, stem);
+        samples.push_back(elapsedMs(start));
+      }
+      char what[600];
+      snprintf(what, sizeof(what), "midi_init %s %d %s", output ? "output" : "input", i, portName);
+      printBenchTiming(fp, out, what, benchTiming(samples));
+    }
+  }
+  saveOpenCosts();
+
+  if (fp) {
+    fclose(fp);
+    char cslMsg[600];
+    snprintf(cslMsg, sizeof(cslMsg), "saved to %s\n", path.c_str());
+    out += cslMsg;
+  }
+  // the reinits may have added slots for devices that arrived meanwhile
+  beginReconcile(false, true);
+}
+
+bool runBenchmark(KbdSectionInfo *sec, int command, int val, int val2, int relmode, HWND hwnd)
+{
+  if (command != benchCommandId) return false;
+
+  if (!midi_init || !GetResourcePath) {
+    ShowConsoleMsg("automidireset: benchmarking needs REAPER 6.47+\n");
+    return true;
+  }
+
+  std::vector<double> notifyMs(g_notifyStats.latencyMs); // main thread state, like the subscribers
+  g_benchNotifyValid = !notifyMs.empty();
+  if (g_benchNotifyValid) g_benchNotify = benchTiming(notifyMs);
+
+#ifdef WIN32
+  // the window thread runs it; printBenchmark() picks up the result on REAPER's thread
+  if (g_benchPending) return true;
+  g_benchPending = true;
+  plugin_register("timer", (void *)printBenchmark);
+  PostMessage(hDummyWindow, WM_MIDI_BENCHMARK, 0, 0);
+#else
+  std::string out;
+  benchmark(out);
+  ShowConsoleMsg(out.c_str());
+#endif
+  return true;
+}
+
+#ifdef WIN32
+
+void printBenchmark()
+{
+  std::string *out = g_benchOutput.exchange(nullptr, std::memory_order_acquire);
+  if (!out) return;
+
+  plugin_register("-timer", (void *)printBenchmark);
+  g_benchPending = false;
+  ShowConsoleMsg(out->c_str());
+  delete out;
+}
+
+#endif
+
+void noteDebounceStart()
+{
+  g_metrics.debounceStarted = std::chrono::steady_clock::now();
+}
+
+void noteDebounceEnd()
+{
+  g_metrics.debounceWaitMs += elapsedMs(g_metrics.debounceStarted);
+  ++g_metrics.debounceCount;
+}
+
+// true if this is the first report of the device arriving (or leaving)
+// within the window. *entry is where a duplicate can see whether its port
+// counts are still needed.
+bool dedupReport(const std::string &identity, bool arrived, int source, DedupEntry **entry)
+{
+  const auto now = std::chrono::steady_clock::now();
+  const auto window = std::chrono::duration<double, std::milli>(g_settings.dedupWindowMs);
+  for (auto it = g_dedup.recent.begin(); it != g_dedup.recent.end();) {
+    it = now - it->second.first >= window ? g_dedup.recent.erase(it) : std::next(it);
+  }
+
+  const std::string key = (arrived ? '+' : '-') + identity;
+  auto it = g_dedup.recent.find(key);
+  if (it == g_dedup.recent.end()) {
+    // a replug is news even within the window
+    g_dedup.recent.erase((arrived ? '-' : '+') + identity);
+    it = g_dedup.recent.insert(std::make_pair(key, DedupEntry { now, source, false })).first;
+    g_dedup.lastFirst = now;
+    ++g_metrics.firstReports;
+    *entry = &it->second;
+    return true;
+  }
+
+  const bool otherSource = it->second.source != source;
+  ++g_metrics.duplicateReports[otherSource ? 1 : 0];
+#ifdef WIN32
+  flightRecord(kFlightDuplicate, kFlightWindowThread, source, otherSource);
+#else
+  flightRecord(kFlightDuplicate, kFlightServiceThread, source, otherSource);
+#endif
+  *entry = &it->second;
+  return false;
+}
+
+// true if a report that can't be linked to a device (ALSA without sysfs,
+// DBT_DEVNODES_CHANGED) follows an identified one within the window
+bool dedupAnonymous()
+{
+  if (g_settings.dedupWindowMs <= 0. || !g_metrics.firstReports) return false;
+  if (elapsedMs(g_dedup.lastFirst) >= g_settings.dedupWindowMs) return false;
+
+  ++g_metrics.anonymousDuplicates;
+  return true;
+}
+
+static void writeCounter(FILE *fp, const char *name, const char *help, const char *type)
+{
+  fprintf(fp, "# HELP automidireset_%s %s\n# TYPE automidireset_%s %s\n", name, help, name, type);
+}
+
+// Write <resource path>/automidireset.prom in the Prometheus textfile format,
+// through a temporary file so that collectors never see a partial one.
+static void writeMetrics()
+{
+  std::string path = std::string(GetResourcePath()) + "/automidireset.prom";
+  std::string tmpPath = path + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (!fp) return;
+
+  static const char * const sourceNames[kNumMetricsSources] = { "libusb", "coremidi", "windows", "sweep", "broker", "alsa" };
+  writeCounter(fp, "events_total", "Device change events received, by source.", "counter");
+  for (int i = 0; i < kNumMetricsSources; ++i) {
+    fprintf(fp, "automidireset_events_total{source=\"%s\"} %llu\n", sourceNames[i], (unsigned long long)g_metrics.events[i].load());
+  }
+  writeCounter(fp, "reinits_total", "Port reconciliations, full (after midi_reinit) or targeted.", "counter");
+  fprintf(fp, "automidireset_reinits_total{kind=\"full\"} %llu\n", (unsigned long long)g_metrics.fullReinits.load());
+  fprintf(fp, "automidireset_reinits_total{kind=\"targeted\"} %llu\n", (unsigned long long)g_metrics.targetedReinits.load());
+  writeCounter(fp, "reinits_avoided_total", "Events or reinits that didn't cause a reinit of their own.", "counter");
+  fprintf(fp, "automidireset_reinits_avoided_total{reason=\"coalesced\"} %llu\n", (unsigned long long)g_metrics.coalescedEvents.load());
+  fprintf(fp, "automidireset_reinits_avoided_total{reason=\"excluded\"} %llu\n", (unsigned long long)g_metrics.excludedEvents.load());
+  fprintf(fp, "automidireset_reinits_avoided_total{reason=\"deferred\"} %llu\n", (unsigned long long)g_metrics.deferredReinits.load());
+  writeCounter(fp, "device_reports_total", "Device reports by whether they restarted the debounce (first) or repeated a recent one (duplicate).", "counter");
+  fprintf(fp, "automidireset_device_reports_total{result=\"first\"} %llu\n", (unsigned long long)g_metrics.firstReports.load());
+  fprintf(fp, "automidireset_device_reports_total{result=\"duplicate\",from=\"same_source\"} %llu\n", (unsigned long long)g_metrics.duplicateReports[0].load());
+  fprintf(fp, "automidireset_device_reports_total{result=\"duplicate\",from=\"other_source\"} %llu\n", (unsigned long long)g_metrics.duplicateReports[1].load());
+  fprintf(fp, "automidireset_device_reports_total{result=\"duplicate\",from=\"unidentified\"} %llu\n", (unsigned long long)g_metrics.anonymousDuplicates.load());
+  writeCounter(fp, "debounce_wait_seconds", "Time from the first event to the reinit.", "summary");
+  fprintf(fp, "automidireset_debounce_wait_seconds_sum %.6f\n", g_metrics.debounceWaitMs / 1000.);
+  fprintf(fp, "automidireset_debounce_wait_seconds_count %llu\n", (unsigned long long)g_metrics.debounceCount);
+  writeCounter(fp, "ports", "MIDI ports known to REAPER at the last reconcile.", "gauge");
+  {
+    PortTableReader reader;
+    for (int i = 0; i < 2; ++i) {
+      const std::vector<PortState> &ports = reader.snapshot().ports[i];
+      size_t attached = std::count_if(ports.begin(), ports.end(), [](const PortState &port) { return port.attached; });
+      fprintf(fp, "automidireset_ports{direction=\"%s\",state=\"attached\"} %zu\n", i ? "output" : "input", attached);
+      fprintf(fp, "automidireset_ports{direction=\"%s\",state=\"detached\"} %zu\n", i ? "output" : "input", ports.size() - attached);
+    }
+  }
+  writeCounter(fp, "device_registry_total", "Removals resolved from the device registry, and arrivals classified from their descriptors.", "counter");
+  fprintf(fp, "automidireset_device_registry_total{op=\"removal_resolved\"} %llu\n", (unsigned long long)g_metrics.removalsResolved.load());
+  fprintf(fp, "automidireset_device_registry_total{op=\"arrival_classified\"} %llu\n", (unsigned long long)g_metrics.arrivalsClassified.load());
+  writeCounter(fp, "resumes_total", "System resumes from suspend, each settled with a single reinit.", "counter");
+  fprintf(fp, "automidireset_resumes_total %llu\n", (unsigned long long)g_metrics.resumes.load());
+  writeCounter(fp, "midi_init_calls_total", "midi_init calls made by the reconciler.", "counter");
+  fprintf(fp, "automidireset_midi_init_calls_total %d\n", g_reconcileStats.totalCalls);
+  writeCounter(fp, "invocation_duration_seconds", "Wall time of the plugin's timer and window message handlers.", "histogram");
+  static const char * const invocationNames[kNumWatchInvocations] = { "timer", "reinit", "init", "reconcile", "verify" };
+  for (int i = 0; i < kNumWatchInvocations; ++i) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b < WATCH_HISTOGRAM_BUCKETS; ++b) {
+      cumulative += g_watchStats.histogram[i][b];
+      fprintf(fp, "automidireset_invocation_duration_seconds_bucket{handler=\"%s\",le=\"%g\"} %llu\n",
+              invocationNames[i], (2u << b) / 1e6, (unsigned long long)cumulative);
+    }
+    fprintf(fp, "automidireset_invocation_duration_seconds_bucket{handler=\"%s\",le=\"+Inf\"} %llu\n", invocationNames[i], (unsigned long long)cumulative);
+    fprintf(fp, "automidireset_invocation_duration_seconds_sum{handler=\"%s\"} %.6f\n", invocationNames[i], g_watchStats.totalUs[i] / 1e6);
+    fprintf(fp, "automidireset_invocation_duration_seconds_count{handler=\"%s\"} %llu\n", invocationNames[i], (unsigned long long)cumulative);
+  }
+  writeCounter(fp, "stalls_total", "Handler invocations slower than stall_threshold_ms.", "counter");
+  fprintf(fp, "automidireset_stalls_total %d\n", g_watchStats.stalls);
+  fclose(fp);
+  replaceFile(tmpPath, path);
+}
+
+void maybeWriteMetrics()
+{
+  if (g_settings.metricsIntervalS <= 0. || !GetResourcePath) return;
+  if (elapsedMs(g_metrics.lastWrite) < g_settings.metricsIntervalS * 1000.) return;
+
+  g_metrics.lastWrite = std::chrono::steady_clock::now();
+  writeMetrics();
+}
+
+// Cost estimate for the midi_init of one port: its profile, or else the
+// mean over all profiled devices
+static double estimatedOpenMs(const std::string &stem)
+{
+  auto it = g_openCosts.find(stem);
+  if (it != g_openCosts.end()) return it->second.avgMs;
+
+  double total = 0.;
+  for (const auto &entry : g_openCosts) total += entry.second.avgMs;
+  return g_openCosts.empty() ? 0. : total / g_openCosts.size();
+}
+
+void shadowPlan()
+{
+  g_shadow.active = false;
+  if (!g_settings.shadowMode || !midi_init) return;
+
+  g_shadow.plan.clear();
+  g_shadow.estimatedMs = 0.;
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<bool> &list = output ? outputsList : inputsList;
+    std::vector<bool> &predicted = g_shadow.predicted[output];
+    int numPorts = output ? GetNumMIDIOutputs() : GetNumMIDIInputs();
+    predicted.assign(numPorts, false);
+    for (int i = 0; i < numPorts; ++i) {
+      PortRef port { i, output != 0 };
+      char portName[512] = "";
+      predicted[i] = portAttached(port, portName, 512);
+      bool known = i < (int)list.size() && list[i];
+      if (*portName && known != predicted[i] && portNameAllowed(portName)) {
+        g_shadow.plan.push_back(port);
+        g_shadow.estimatedMs += estimatedOpenMs(portNameStem(portName));
+      }
+    }
+  }
+  g_shadow.active = true;
+}
+
+void shadowCompare()
+{
+  if (!g_shadow.active) return;
+  g_shadow.active = false;
+
+  // the targeted plan ends with the attachment state it saw; any port whose
+  // final state differs (or that it didn't know about) is one it would have
+  // missed. Unnamed and excluded ports are left alone by either, as in reconcileStep().
+  int missed = 0;
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<bool> &list = output ? outputsList : inputsList;
+    const std::vector<bool> &predicted = g_shadow.predicted[output];
+    const std::vector<std::string> &names = g_portNames[output];
+    for (size_t i = 0; i < list.size(); ++i) {
+      const char *portName = i < names.size() ? names[i].c_str() : "";
+      if (!*portName || !portNameAllowed(portName)) continue;
+      if (i >= predicted.size() ? list[i] : (predicted[i] != list[i])) ++missed;
+    }
+  }
+
+  // work time only: the reconcile's wall time includes the idle gaps between its ticks
+  double actualMs = g_shadow.reinitMs + g_reconcile.workMs;
+  ++g_shadowStats.runs;
+  if (!missed) ++g_shadowStats.matched;
+  g_shadowStats.portsPlanned += (int)g_shadow.plan.size();
+  g_shadowStats.portsActual += g_reconcileStats.lastPorts;
+  g_shadowStats.estimatedMs += g_shadow.estimatedMs;
+  g_shadowStats.actualMs += actualMs;
+
+  if (g_settings.shadowMode >= 2) {
+    char cslMsg[600]; // room for a whole port name below
+    snprintf(cslMsg, sizeof(cslMsg), "automidireset shadow: targeted plan %d ports, ~%.1f ms; full reinit %d ports, %.1f ms (midi_reinit %.1f ms); %s\n",
+             (int)g_shadow.plan.size(), g_shadow.estimatedMs, g_reconcileStats.lastPorts, actualMs, g_shadow.reinitMs,
+             missed ? "plan would have missed ports" : "same final state");
+    ShowConsoleMsg(cslMsg);
+    for (const PortRef &port : g_shadow.plan) {
+      char portName[512] = "";
+      portAttached(port, portName, 512);
+      snprintf(cslMsg, sizeof(cslMsg), "  planned %s %d %s\n", port.output ? "OUTPUT" : "INPUT", port.index, portName);
+      ShowConsoleMsg(cslMsg);
+    }
+  }
+}
+
+#ifndef __linux__
+
+#ifdef WIN32
+
+uint64_t osDeviceFingerprint()
+{
+  uint64_t hash = 14695981039346656037ull;
+  UINT numInputs = midiInGetNumDevs(), numOutputs = midiOutGetNumDevs();
+  fingerprintMix(hash, numInputs);
+  fingerprintMix(hash, numOutputs);
+  for (UINT i = 0; i < numInputs; ++i) {
+    MIDIINCAPS caps;
+    if (midiInGetDevCaps(i, &caps, sizeof(caps)) != MMSYSERR_NOERROR) continue;
+    fingerprintMix(hash, ((uint64_t)caps.wMid << 16) | caps.wPid);
+    for (const TCHAR *c = caps.szPname; *c; ++c) fingerprintMix(hash, (uint64_t)*c);
+  }
+  for (UINT i = 0; i < numOutputs; ++i) {
+    MIDIOUTCAPS caps;
+    if (midiOutGetDevCaps(i, &caps, sizeof(caps)) != MMSYSERR_NOERROR) continue;
+    fingerprintMix(hash, ((uint64_t)caps.wMid << 16) | caps.wPid);
+    for (const TCHAR *c = caps.szPname; *c; ++c) fingerprintMix(hash, (uint64_t)*c);
+  }
+  return hash;
+}
+
+#else // __APPLE__
+
+uint64_t osDeviceFingerprint()
+{
+  uint64_t hash = 14695981039346656037ull;
+  ItemCount numSources = MIDIGetNumberOfSources(), numDestinations = MIDIGetNumberOfDestinations();
+  fingerprintMix(hash, numSources);
+  fingerprintMix(hash, numDestinations);
+  for (ItemCount i = 0; i < numSources; ++i) {
+    SInt32 uniqueID = 0;
+    MIDIObjectGetIntegerProperty(MIDIGetSource(i), kMIDIPropertyUniqueID, &uniqueID);
+    fingerprintMix(hash, (uint32_t)uniqueID);
+  }
+  for (ItemCount i = 0; i < numDestinations; ++i) {
+    SInt32 uniqueID = 0;
+    MIDIObjectGetIntegerProperty(MIDIGetDestination(i), kMIDIPropertyUniqueID, &uniqueID);
+    fingerprintMix(hash, (uint32_t)uniqueID);
+  }
+  return hash;
+}
+
+#endif
+
+// true if the device set no longer matches the last reconcile
+bool sweepMismatch()
+{
+  if (!g_sweep.schedule.due() || g_reconcile.active) return false;
+
+  uint64_t fingerprint = osDeviceFingerprint();
+  if (fingerprint == g_sweep.reconciled) return false;
+
+  g_sweep.reconciled = fingerprint; // one event per change
+  ++g_metrics.events[kSourceSweep];
+  flightRecord(kFlightSweepMismatch, FLIGHT_REAPER_THREAD);
+  g_sweep.schedule.activity();
+  return true;
+}
+
+#endif
+
+// midi_reinit() followed by a full reconcile
+void fullReinit()
+{
+  // ports brought up by a targeted reconcile while the reinit was deferred
+  // are still news to this one: their ready times, verification and the
+  // subscribers' diff all come from the full reconcile
+  for (const PortRef &port : g_defer.targeted) {
+    std::vector<bool> &list = port.output ? outputsList : inputsList;
+    if (port.index < (int)list.size()) list[port.index] = false;
+  }
+  g_defer.targeted.clear();
+
+  shadowPlan();
+  {
+    WatchScope watch(kStageMidiReinit);
+    const auto reinitStart = std::chrono::steady_clock::now();
+    midi_reinit(); // this looks like overkill, but appears to be necessary on some systems
+    g_shadow.reinitMs = elapsedMs(reinitStart);
+    flightRecord(kFlightMidiReinit, FLIGHT_REAPER_THREAD, 0, (uint32_t)(g_shadow.reinitMs * 1000.));
+  }
+  beginReconcile(false, true);
+}
+
+// true if a port of a quarantined device is attached and still attached,
+// so that a midi_reinit would reopen it although it didn't change
+static bool quarantinedDeviceUnchanged()
+{
+  if (g_settings.quarantineMs <= 0. || !midi_init) return false;
+
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<bool> &list = output ? outputsList : inputsList;
+    for (int i = 0; i < (int)list.size(); ++i) {
+      char portName[512] = "";
+      if (list[i] && portAttached(PortRef { i, output != 0 }, portName, 512) && quarantined(portNameStem(portName))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// true if more ports are present than REAPER has attached slots for, by
+// direction: a device that only midi_reinit can add
+static bool unslottedPorts(const int present[2])
+{
+  for (int output = 0; output < 2; ++output) {
+    int numPorts = output ? GetNumMIDIOutputs() : GetNumMIDIInputs();
+    int attached = 0;
+    for (int i = 0; i < numPorts && attached < present[output]; ++i) {
+      char portName[512] = "";
+      if (portAttached(PortRef { i, output != 0 }, portName, 512)) ++attached;
     }
+    if (attached < present[output]) return true;
+  }
+  return false;
+}
+
+// Ports present in the OS, by direction; false if it can't tell. On Linux
+// the device events announce their port counts instead, see
+// expectedPortsReady().
+static bool osPortCounts(int counts[2])
+{
+#ifdef WIN32
+  counts[0] = (int)midiInGetNumDevs();
+  counts[1] = (int)midiOutGetNumDevs();
+  return true;
+#elif defined(__APPLE__)
+  counts[0] = (int)MIDIGetNumberOfSources();
+  counts[1] = (int)MIDIGetNumberOfDestinations();
+  return true;
+#else
+  return false;
+#endif
+}
+
+static bool osHasUnslottedPorts()
+{
+  int present[2];
+  return osPortCounts(present) && unslottedPorts(present);
+}
+
+// The reinit once a device change has settled. midi_reinit reopens every
+// device, so while a quarantined one is attached and unchanged, a
+// reconcile of the known slots stands in for it and only midi_inits the
+// ports that changed. If it finds none, the change must be a device REAPER
+// has no slot for yet, and it does the midi_reinit after all; so it does
+// if the OS has more ports than REAPER's attached slots, since a new device
+// may come along with a change in a known slot.
+// newSlotsNeeded: the device events announced ports that aren't in a known slot.
+static void reinitForDeviceChange(bool newSlotsNeeded)
+{
+  if (newSlotsNeeded || !quarantinedDeviceUnchanged() || osHasUnslottedPorts()) {
+    fullReinit();
+    return;
+  }
+  g_defer.targeted.clear(); // brought up already, and there's no midi_reinit to redo them
+  beginReconcile(false, false);
+  g_reconcile.reinitIfIdle = true;
+}
+
+// Called when a full reinit is due: true if it should wait for the transport
+// to stop (within the max_defer_ms bound). Reopening every device mid-take
+// causes dropouts, so in the meantime only newly attached ports get a
+// targeted midi_init.
+static bool reinitDeferred()
+{
+  if (!g_settings.deferPolicy || !GetPlayState) return false;
+
+  int playState;
+  {
+    WatchScope watch(kStagePlayState);
+    playState = GetPlayState(); // &1 playing, &4 recording
+  }
+  if (!(playState & (g_settings.deferPolicy >= 2 ? 5 : 4))) return false;
+  if (!(playState & 4) && g_benchReinitMs >= 0. && g_benchReinitMs < g_settings.maxPlaybackReinitMs) {
+    return false; // only playing, and the reinit is known to be quick here
+  }
+
+  if (!g_defer.active) {
+    flightRecord(kFlightReinitDeferred, FLIGHT_REAPER_THREAD, playState);
+    ++g_metrics.deferredReinits;
+    g_defer.active = true;
+    g_defer.targetedDone = false;
+    g_defer.since = std::chrono::steady_clock::now();
+    ++g_deferStats.count;
   }
+  return elapsedMs(g_defer.since) < g_settings.maxDeferMs;
+}
+
+static void endDeferral()
+{
+  if (!g_defer.active) return;
+
+  double deferredMs = elapsedMs(g_defer.since);
+  g_deferStats.totalMs += deferredMs;
+  g_deferStats.maxMs = std::max(g_deferStats.maxMs, deferredMs);
+  g_defer.active = false;
 }
 
 #ifndef WIN32 // __linux__ or __APPLE__
 
-static atomic<bool> g_inDelayTimer;
+static bool g_reinitDue = false; // debounce expired, waiting on reinitDeferred()
+static bool g_newSlotsNeeded = false; // for reinitForDeviceChange(), decided when the debounce expired
+static bool g_inDelayTimer = false; // REAPER's thread only, like the rest of the debounce
 static std::chrono::time_point<std::chrono::steady_clock> start;
 
+// true once as many ports have come back as the arriving devices announced.
+// REAPER only adds slots in midi_reinit, and a replugged device gets its old
+// slot back, so this counts the known slots that are attached again since
+// the last reconcile; brand-new devices wait out the full debounce.
+static bool expectedPortsReady()
+{
+  if (g_expectedUnknown.load(std::memory_order_relaxed)) return false;
+
+  int expected[2] = { g_expectedInputs.load(std::memory_order_relaxed), g_expectedOutputs.load(std::memory_order_relaxed) };
+  if (!expected[0] && !expected[1]) return false;
+
+  for (int output = 0; output < 2; ++output) {
+    const std::vector<bool> &list = output ? outputsList : inputsList;
+    int attached = 0;
+    for (int i = 0; i < (int)list.size() && attached < expected[output]; ++i) {
+      char portName[512] = "";
+      if (!list[i] && portAttached(PortRef { i, output != 0 }, portName, 512) && portNameAllowed(portName)) ++attached;
+    }
+    if (attached < expected[output]) return false;
+  }
+  return true;
+}
+
+// true once the debounce that started `elapsed` ms ago may reinit
+static bool debounceSettled(long long elapsed)
+{
+#ifdef __linux__
+  if (g_resume.active) {
+    return elapsed > RESUME_QUIET_MS || elapsedMs(g_resume.since) > RESUME_MAX_MS;
+  }
+#endif
+  return elapsed > 1500 // 1.5s delay is safe
+    || (elapsed > 250 && expectedPortsReady()); // give the driver a moment to settle
+}
+
+#ifdef __linux__
+
+int64_t suspendClockOffsetMs()
+{
+  timespec boot, mono;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  return (int64_t)(boot.tv_sec - mono.tv_sec) * 1000 + (boot.tv_nsec - mono.tv_nsec) / 1000000;
+}
+
+void beginResume(int64_t suspendedMs)
+{
+  flightRecord(kFlightResume, kFlightMainThread, 0, (uint32_t)std::min<int64_t>(suspendedMs, UINT32_MAX));
+  ++g_metrics.resumes;
+  ++g_resumeStats.count;
+  g_resumeStats.totalSuspendedS += suspendedMs / 1000.;
+  if (!g_resume.active) {
+    g_resume.active = true;
+    g_resume.events = 0;
+    g_resume.since = std::chrono::steady_clock::now();
+  }
+  noteDeviceEvent(); // start (or restart) the debounce even if nothing has dropped off yet
+}
+
+void endResume()
+{
+  if (!g_resume.active) return;
+
+  g_resumeStats.lastEvents = g_resume.events;
+  g_resumeStats.lastSettleMs = elapsedMs(g_resume.since);
+  g_resume.active = false;
+}
+
+#endif
+
+static void reaperTimerTick();
+
 void reaperTimer()
+{
+  watchBegin(kWatchTimer);
+  reaperTimerTick();
+  watchEnd();
+}
+
+void reaperTimerTick()
 {
   if (!g_listsInited) {
     initLists();
     g_listsInited = true;
   }
-  if (g_eventReceived) {
+#ifdef __linux__
+  if (int64_t suspendedMs = g_resumeDetectedMs.exchange(0, std::memory_order_relaxed)) {
+    beginResume(suspendedMs);
+  }
+#endif
+  if (takeDeviceEvent()) {
+    if (!g_inDelayTimer) {
+      noteDebounceStart();
+    }
+    else {
+      ++g_metrics.coalescedEvents;
+    }
+#ifdef __linux__
+    if (g_resume.active) ++g_resume.events;
+#endif
+    flightRecord(g_inDelayTimer ? kFlightDebounceRestart : kFlightDebounceStart, kFlightMainThread);
     start = std::chrono::steady_clock::now();
     g_inDelayTimer = true;
-    g_eventReceived = false;
   }
-  else if (g_inDelayTimer) {
-    const auto end = std::chrono::steady_clock::now();
-    if (((end - start) / 1ms) > 1500) { // 1.5s delay is safe
-      midi_reinit();
-      updateLists();
-      g_inDelayTimer = false;
+  else if (g_inDelayTimer) {
+    const auto end = std::chrono::steady_clock::now();
+    const auto elapsed = (end - start) / 1ms;
+    if (debounceSettled(elapsed)) {
+#ifdef __linux__
+      endResume();
+#endif
+      g_reinitDue = true;
+      g_newSlotsNeeded = g_expectedUnknown.load(std::memory_order_relaxed)
+        || ((g_expectedInputs.load(std::memory_order_relaxed) || g_expectedOutputs.load(std::memory_order_relaxed)) && !expectedPortsReady());
+      g_defer.targetedDone = false;
+      noteDebounceEnd();
+      g_inDelayTimer = false;
+      g_expectedInputs.store(0, std::memory_order_relaxed);
+      g_expectedOutputs.store(0, std::memory_order_relaxed);
+      g_expectedUnknown.store(false, std::memory_order_relaxed);
+    }
+  }
+  if (g_reinitDue) {
+    if (!reinitDeferred()) {
+      endDeferral();
+      reinitForDeviceChange(g_newSlotsNeeded); // the port scan starts with the next tick
+      g_reinitDue = false;
+      return;
+    }
+    if (!g_defer.targetedDone) {
+      g_defer.targetedDone = true;
+      beginReconcile(true, false);
+    }
+  }
+  if (g_reconcile.active) {
+    reconcileStep(g_settings.sliceBudgetMs);
+  }
+  else if (g_verify.active && std::chrono::steady_clock::now() >= g_verify.next) {
+    verifyStep();
+  }
+  else {
+    if (g_portTable.dirty) publishPortTable();
+    sampleTraffic();
+    maybeWriteMetrics();
+    maybePublishStatus();
+#ifndef __linux__
+    if (!g_inDelayTimer && !g_reinitDue && sweepMismatch()) {
+      noteDeviceEvent();
     }
+#endif
   }
 }
 
@@ -351,12 +3274,92 @@ bool RegisterDeviceInterfaceToHwnd(HWND hwnd, HDEVNOTIFY *hDeviceNotify)
   return true;
 }
 
+static bool g_midiCheckPending = false;
+
+// "VID_xxxx&PID_xxxx instance" for dedupReport(), from a device interface
+// path like \\?\USB#VID_0582&PID_012F&MI_01#7&2a1b3c&0&0001#{guid}. The
+// interfaces of a composite device share its instance up to the last '&'.
+// Empty if it isn't a USB device.
+static std::string deviceIdentity(const TCHAR *name)
+{
+  std::string path;
+  for (const TCHAR *c = name; *c; ++c) path += (char)toupper((unsigned char)*c); // ASCII
+  size_t start = path.find("USB#");
+  if (start == std::string::npos) return std::string();
+  start += 4;
+  size_t end = path.find('#', start);
+  if (end == std::string::npos) return std::string();
+  std::string hardwareId = path.substr(start, end - start);
+  std::string instance = path.substr(end + 1, path.find('#', end + 1) - end - 1);
+
+  size_t mi = hardwareId.find("&MI_");
+  if (mi != std::string::npos) {
+    hardwareId.erase(mi);
+    instance.erase(std::min(instance.size(), instance.rfind('&')));
+  }
+  return hardwareId + " " + instance;
+}
+
+// false if the device rules exclude the device, or if another interface of
+// the same device was just reported
+static bool deviceReportWanted(PDEV_BROADCAST_DEVICEINTERFACE pdi, bool arrived)
+{
+  const std::string identity = deviceIdentity(pdi->dbcc_name);
+  if (identity.empty()) return true;
+
+  unsigned vid, pid;
+  if (sscanf(identity.c_str(), "VID_%4x&PID_%4x", &vid, &pid) == 2 && !usbIdAllowed((uint16_t)vid, (uint16_t)pid)) {
+    ++g_metrics.excludedEvents;
+    return false;
+  }
+  DedupEntry *dedup;
+  return dedupReport(identity, arrived, kSourceWindows, &dedup);
+}
+
+// (re)start the debounce timer
+static void startMidiCheck(HWND hwnd)
+{
+  if (g_midiCheckPending) {
+    ++g_metrics.coalescedEvents;
+  }
+  else {
+    g_midiCheckPending = true;
+    noteDebounceStart();
+  }
+  SetTimer(hwnd, 0, midi_init ? 1500 : 500, (TIMERPROC)&ScheduleMidiCheck);
+}
+
 void CALLBACK ScheduleMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime)
 {
   PostMessage(hDummyWindow, WM_MIDI_REINIT, 0, 0);
   KillTimer(hwnd, 0);
 }
 
+// housekeeping on the window thread, once a second
+void CALLBACK MaintenanceCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime)
+{
+  if (g_portTable.dirty) publishPortTable();
+  sampleTraffic();
+  maybeWriteMetrics();
+  maybePublishStatus();
+  if (!g_midiCheckPending && sweepMismatch()) {
+    startMidiCheck(hwnd);
+  }
+}
+
+void CALLBACK VerifyMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime)
+{
+  PostMessage(hDummyWindow, WM_MIDI_VERIFY, 0, 0);
+  KillTimer(hwnd, 2);
+}
+
+// re-check a reinit held back by reinitDeferred()
+void CALLBACK DeferredMidiCheck(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime)
+{
+  PostMessage(hDummyWindow, WM_MIDI_REINIT, 1, 0);
+  KillTimer(hwnd, 1);
+}
+
 INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
   LRESULT lRet = 0;
@@ -364,6 +3367,11 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
   PDEV_BROADCAST_DEVICEINTERFACE pdi;
   static HDEVNOTIFY hDeviceNotify;
 
+  const bool watched = msg >= WM_MIDI_REINIT && msg <= WM_MIDI_VERIFY;
+  if (watched) {
+    watchBegin(kWatchReinitMsg + (msg - WM_MIDI_REINIT));
+  }
+
   switch (msg) {
 
   case WM_MIDI_INIT:
@@ -371,15 +3379,60 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
     break;
 
   case WM_MIDI_REINIT:
-    //ShowConsoleMsg("MIDI Reinit\n");
-    midi_reinit(); // this looks like overkill, but appears to be necessary on some systems
-    updateLists();
+    if (!wParam) {
+      g_defer.targetedDone = false; // a fresh device change
+      g_midiCheckPending = false;
+      noteDebounceEnd();
+    }
+    if (reinitDeferred()) {
+      SetTimer(hwnd, 1, 250, (TIMERPROC)&DeferredMidiCheck);
+      if (g_defer.targetedDone) break;
+      g_defer.targetedDone = true;
+      beginReconcile(true, false);
+    }
+    else {
+      endDeferral();
+      //ShowConsoleMsg("MIDI Reinit\n");
+      reinitForDeviceChange(false); // no port counts from WM_DEVICECHANGE
+    }
+    // fall through
+
+  case WM_MIDI_RECONCILE:
+    if (msg == WM_MIDI_RECONCILE && wParam != (WPARAM)g_reconcile.generation) {
+      break; // queued for a reconcile that has since been restarted, which has its own
+    }
+    // yield between slices so that other messages get handled
+    if (!reconcileStep(g_settings.sliceBudgetMs)) {
+      PostMessage(hwnd, WM_MIDI_RECONCILE, (WPARAM)g_reconcile.generation, 0);
+    }
+    else if (g_verify.active) {
+      SetTimer(hwnd, 2, VERIFY_FIRST_DELAY_MS, (TIMERPROC)&VerifyMidiCheck);
+    }
+    break;
+
+  case WM_MIDI_VERIFY: {
+    int delayMs = verifyStep();
+    if (delayMs >= 0) {
+      SetTimer(hwnd, 2, delayMs, (TIMERPROC)&VerifyMidiCheck);
+    }
+    break;
+  }
+
+  case WM_MIDI_BENCHMARK: {
+    std::string *out = new std::string;
+    benchmark(*out);
+    g_benchOutput.store(out, std::memory_order_release);
+    if (g_reconcile.active) {
+      PostMessage(hwnd, WM_MIDI_RECONCILE, (WPARAM)g_reconcile.generation, 0);
+    }
     break;
+  }
 
   case WM_CREATE:
     if (!RegisterDeviceInterfaceToHwnd(hwnd, &hDeviceNotify)) {
       assert(false && "failed to register device interface");
     }
+    SetTimer(hwnd, 3, 1000, (TIMERPROC)&MaintenanceCheck);
 
     break;
 
@@ -396,6 +3449,9 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
     break;
 
   case WM_DEVICECHANGE: {
+    flightRecord(kFlightNotify, kFlightWindowThread, (int)wParam);
+    ++g_metrics.events[kSourceWindows];
+    g_sweep.schedule.activity();
     switch (wParam) {
     case DBT_DEVICEARRIVAL:
 
@@ -419,7 +3475,9 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
 
         It works but it's not pretty.
       */
-      SetTimer(hwnd, 0, midi_init ? 1500 : 500, (TIMERPROC)&ScheduleMidiCheck);
+      if (deviceReportWanted(pdi, true)) {
+        startMidiCheck(hwnd);
+      }
       break;
 
     case DBT_DEVICEREMOVECOMPLETE:
@@ -435,11 +3493,15 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
         break;
       }
 
-      SetTimer(hwnd, 0, midi_init ? 1500 : 500, (TIMERPROC)&ScheduleMidiCheck);
+      if (deviceReportWanted(pdi, false)) {
+        startMidiCheck(hwnd);
+      }
       break;
 
     case DBT_DEVNODES_CHANGED:
-      SetTimer(hwnd, 0, midi_init ? 1500 : 500, (TIMERPROC)&ScheduleMidiCheck);
+      if (!dedupAnonymous()) { // usually follows the arrival or removal itself
+        startMidiCheck(hwnd);
+      }
       break;
     }
 
@@ -450,6 +3512,9 @@ INT_PTR WINAPI midi_hardware_status_callback(HWND hwnd, UINT msg, WPARAM wParam,
     return DefWindowProc(hwnd, msg, wParam, lParam);
   }
 
+  if (watched) {
+    watchEnd();
+  }
   return lRet;
 }
 
@@ -491,72 +3556,735 @@ DWORD WINAPI window_thread(LPVOID params)
 
 #elif __linux__
 
-static bool is_midi_device(libusb_device *dev, struct libusb_device_descriptor *desc)
+// Walk the class-specific descriptors of one MIDIStreaming altsetting.
+// The endpoint descriptors (CS_ENDPOINT/MS_GENERAL) say how many embedded jacks
+// hang off each endpoint, which is what the host drivers turn into ports; if a
+// device doesn't provide them, fall back to counting the embedded jacks listed
+// in the interface (embedded IN jacks are host outputs, embedded OUT jacks are
+// host inputs). Returns false if this altsetting isn't a USB-MIDI 1.0 interface.
+static bool parse_ms_interface(const struct libusb_interface_descriptor *altsetting, midi_port_counts *counts)
+{
+  const unsigned char *p = altsetting->extra;
+  int len = altsetting->extra_length;
+  bool haveHeader = false;
+  int jackInputs = 0, jackOutputs = 0;
+
+  while (len >= 3) {
+    int bLength = p[0];
+    if (bLength < 3 || bLength > len) break; // malformed, stop here
+
+    if (p[1] == USB_DT_CS_INTERFACE) {
+      if (p[2] == USB_MS_HEADER && bLength >= 7) {
+        int bcdMSC = p[3] | (p[4] << 8);
+        if (bcdMSC >= 0x0200) return false; // MIDI 2.0 altsetting, not what the drivers bind by default
+        haveHeader = true;
+      }
+      else if (bLength >= 4 && p[3] == USB_MS_JACK_EMBEDDED) {
+        if (p[2] == USB_MS_MIDI_IN_JACK) ++jackOutputs;
+        else if (p[2] == USB_MS_MIDI_OUT_JACK) ++jackInputs;
+      }
+    }
+    p += bLength;
+    len -= bLength;
+  }
+  if (!haveHeader) return false;
+
+  int endpointInputs = 0, endpointOutputs = 0;
+  bool haveEndpoints = false;
+  for (int e = 0; e < altsetting->bNumEndpoints; ++e) {
+    const struct libusb_endpoint_descriptor *endpoint = &altsetting->endpoint[e];
+    const unsigned char *q = endpoint->extra;
+    int qlen = endpoint->extra_length;
+    while (qlen >= 3) {
+      int bLength = q[0];
+      if (bLength < 3 || bLength > qlen) break;
+      if (q[1] == USB_DT_CS_ENDPOINT && q[2] == USB_MS_GENERAL && bLength >= 4) {
+        haveEndpoints = true;
+        if (endpoint->bEndpointAddress & 0x80) endpointInputs += q[3];
+        else endpointOutputs += q[3];
+      }
+      q += bLength;
+      qlen -= bLength;
+    }
+  }
+
+  counts->inputs = haveEndpoints ? endpointInputs : jackInputs;
+  counts->outputs = haveEndpoints ? endpointOutputs : jackOutputs;
+  return true;
+}
+
+static bool is_midi_device(libusb_device *dev, struct libusb_device_descriptor *desc, midi_port_counts *counts)
 {
   bool rv = false;
 
+  counts->inputs = counts->outputs = 0;
   if (desc->bNumConfigurations) {
     struct libusb_config_descriptor *config;
 
-    libusb_device_handle *udev;
-    int ret = libusb_open(dev, &udev);
-    if (ret) {
-      // fprintf(stderr, "Couldn't open device, some information will be missing\n");
-      udev = NULL;
-    }
-
+    // the descriptors are cached by libusb, no need to open the device
     for (int i = 0; i < desc->bNumConfigurations; ++i) {
-      ret = libusb_get_config_descriptor(dev, i, &config);
+      int ret = g_libusb.get_config_descriptor(dev, i, &config);
       if (ret) {
         // fprintf(stderr, "Couldn't get configuration descriptor %d, some information will be missing\n", i);
       }
       else {
         for (int j = 0; j < config->bNumInterfaces; ++j) {
           const struct libusb_interface *interface = &config->interface[j];
+          midi_port_counts ifCounts = { 0, 0 };
           for (int k = 0; k < interface->num_altsetting; ++k) {
             const struct libusb_interface_descriptor *altsetting = &interface->altsetting[k];
             if (altsetting->bInterfaceClass == LIBUSB_CLASS_AUDIO
                 && altsetting->bInterfaceSubClass == 3)
             {
               rv = true;
-              break;
+              // altsettings are alternatives, so take the first MIDI 1.0 one
+              midi_port_counts altCounts;
+              if (!ifCounts.inputs && !ifCounts.outputs && parse_ms_interface(altsetting, &altCounts)) {
+                ifCounts = altCounts;
+              }
             }
           }
-          if (rv) break;
+          counts->inputs += ifCounts.inputs;
+          counts->outputs += ifCounts.outputs;
         }
-        libusb_free_config_descriptor(config);
-        if (rv) break;
+        g_libusb.free_config_descriptor(config);
+        if (rv) break; // only one configuration can be active
       }
     }
-    if (udev) libusb_close(udev);
   }
   return rv;
 }
 
+// "bus path VID:PID serial", see dedupReport(). The serial comes from sysfs,
+// libusb would have to open the device to read it.
+std::string usbIdentity(const char *path, uint16_t vid, uint16_t pid)
+{
+  char serial[128] = "";
+  std::string serialPath = std::string("/sys/bus/usb/devices/") + path + "/serial";
+  if (FILE *fp = fopen(serialPath.c_str(), "r")) {
+    if (!fgets(serial, sizeof(serial), fp)) serial[0] = '\0';
+    serial[strcspn(serial, "\r\n")] = '\0';
+    fclose(fp);
+  }
+  char identity[192];
+  snprintf(identity, sizeof(identity), "%s %04x:%04x %s", path, vid, pid, serial);
+  return identity;
+}
+
+// true if it was a registered MIDI device our rules allow
+bool usb_device_left(uint16_t key, int source)
+{
+  ++g_metrics.events[source];
+  auto it = g_usbDevices.find(key);
+  if (it == g_usbDevices.end()) {
+    return false; // not a MIDI device
+  }
+  ++g_metrics.removalsResolved;
+  const usb_midi_device &device = it->second;
+  if (!usbDeviceAllowed(device.vid, device.pid, device.path.c_str())) {
+    // the subscribers apply their own rules
+    brokerPublish(kBrokerLeft, device.vid, device.pid, NULL, device.path.c_str());
+    ++g_metrics.excludedEvents;
+    g_usbDevices.erase(it);
+    return false;
+  }
+  DedupEntry *dedup;
+  const bool first = dedupReport(device.identity, false, source, &dedup);
+  if (first) brokerPublish(kBrokerLeft, device.vid, device.pid, NULL, device.path.c_str());
+  g_usbDevices.erase(it);
+  flightRecord(kFlightHotplugLeft, kFlightServiceThread, key);
+  if (first) {
+    g_expectedUnknown.store(true, std::memory_order_relaxed); // REAPER keeps the slots of removed ports around
+    noteDeviceEvent();
+  }
+  return true;
+}
+
+// user_data is the MetricsSource: NULL for libusb's own callbacks
 static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
 {
+  const uint16_t key = usb_device_key(dev);
+  const int source = (int)(intptr_t)user_data;
+
+  if (source != kSourceSweep) g_usbSweep.activity();
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+    usb_device_left(key, source);
+    return 0;
+  }
+
   struct libusb_device_descriptor desc;
+  midi_port_counts counts;
   int rc;
 
-  rc = libusb_get_device_descriptor(dev, &desc);
+  if (!g_usbEnumerating && source != kSourceSweep) { // the sweep only counts MIDI devices
+    ++g_metrics.events[source];
+    ++g_metrics.arrivalsClassified;
+  }
+  rc = g_libusb.get_device_descriptor(dev, &desc);
   if (LIBUSB_SUCCESS != rc) {
     // ShowConsoleMsg("Error getting device descriptor\n");
     return 0;
   }
 
-  if (is_midi_device(dev, &desc)) {
-    g_eventReceived = true;
+  if (is_midi_device(dev, &desc, &counts)) {
+    char path[32];
+    usb_device_path(dev, path, sizeof(path));
+    usb_midi_device &device = g_usbDevices[key];
+    device = usb_midi_device { ++g_usbSession, desc.idVendor, desc.idProduct, counts, path, usbIdentity(path, desc.idVendor, desc.idProduct) };
+    if (!usbDeviceAllowed(desc.idVendor, desc.idProduct, path)) {
+      // registered all the same, and published: the subscribers apply their own rules
+      if (!g_usbEnumerating) {
+        ++g_metrics.excludedEvents;
+        brokerPublish(kBrokerArrived, desc.idVendor, desc.idProduct, &counts, path);
+      }
+      return 0;
+    }
+    flightRecord(kFlightHotplugArrived, kFlightServiceThread, key, ((uint32_t)counts.inputs << 16) | (uint16_t)counts.outputs);
+    if (g_usbEnumerating) {
+      return 0;
+    }
+    DedupEntry *dedup;
+    const bool first = dedupReport(device.identity, true, source, &dedup);
+    const bool hasCounts = counts.inputs || counts.outputs;
+    if (hasCounts && !dedup->counted) {
+      g_expectedInputs.fetch_add(counts.inputs, std::memory_order_relaxed);
+      g_expectedOutputs.fetch_add(counts.outputs, std::memory_order_relaxed);
+      dedup->counted = true;
+    }
+    if (!first) {
+      return 0; // the debounce already knows about it
+    }
+    brokerPublish(kBrokerArrived, desc.idVendor, desc.idProduct, &counts, path);
+    if (!hasCounts) {
+      g_expectedUnknown.store(true, std::memory_order_relaxed);
+    }
+    noteDeviceEvent();
+  }
+  else {
+    g_usbDevices.erase(key); // address reused by a non-MIDI device
   }
 
   return 0;
 }
 
+// Compare the bus with the registry, for hotplug events libusb never
+// delivered. The fingerprint over every device keeps this to one
+// g_libusb.get_device_list() while nothing changes. Service thread only.
+bool usb_sweep()
+{
+  static uint64_t lastFingerprint = 0;
+  static std::unordered_map<uint16_t, uint32_t> notMidi; // key -> (vid << 16) | pid, classified once
+
+  libusb_device **list;
+  ssize_t numDevices = g_libusb.get_device_list(g_usbCtx, &list);
+  if (numDevices < 0) return false;
+
+  // order independent, libusb doesn't promise any
+  uint64_t fingerprint = 0;
+  for (ssize_t i = 0; i < numDevices; ++i) {
+    struct libusb_device_descriptor desc;
+    if (g_libusb.get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS) continue;
+    uint64_t hash = 14695981039346656037ull;
+    fingerprintMix(hash, usb_device_key(list[i]));
+    fingerprintMix(hash, ((uint32_t)desc.idVendor << 16) | desc.idProduct);
+    fingerprint += hash;
+  }
+  if (fingerprint == lastFingerprint) {
+    g_libusb.free_device_list(list, 1);
+    return false;
+  }
+  lastFingerprint = fingerprint;
+
+  bool mismatch = false;
+  std::unordered_set<uint16_t> present;
+  for (ssize_t i = 0; i < numDevices; ++i) {
+    libusb_device *dev = list[i];
+    struct libusb_device_descriptor desc;
+    if (g_libusb.get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS) continue;
+
+    const uint16_t key = usb_device_key(dev);
+    const uint32_t id = ((uint32_t)desc.idVendor << 16) | desc.idProduct;
+    present.insert(key);
+    auto it = g_usbDevices.find(key);
+    if (it != g_usbDevices.end() && it->second.vid == desc.idVendor && it->second.pid == desc.idProduct) continue;
+    if (it == g_usbDevices.end()) {
+      auto skip = notMidi.find(key);
+      if (skip != notMidi.end() && skip->second == id) continue;
+    }
+    else if (usb_device_left(key, kSourceSweep)) { // its address was reused
+      mismatch = true;
+    }
+
+    const uint32_t session = g_usbSession;
+    hotplug_callback(NULL, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, (void *)(intptr_t)kSourceSweep);
+    if (g_usbSession != session) {
+      notMidi.erase(key);
+      const usb_midi_device &device = g_usbDevices[key];
+      if (usbDeviceAllowed(device.vid, device.pid, device.path.c_str())) {
+        ++g_metrics.events[kSourceSweep];
+        mismatch = true;
+      }
+    }
+    else {
+      notMidi[key] = id;
+    }
+  }
+  g_libusb.free_device_list(list, 1);
+  for (auto it = notMidi.begin(); it != notMidi.end();) {
+    it = present.count(it->first) ? std::next(it) : notMidi.erase(it);
+  }
+
+  std::vector<uint16_t> gone;
+  for (const auto &entry : g_usbDevices) {
+    if (!present.count(entry.first)) gone.push_back(entry.first);
+  }
+  for (uint16_t key : gone) {
+    mismatch |= usb_device_left(key, kSourceSweep);
+  }
+
+  if (mismatch) flightRecord(kFlightSweepMismatch, kFlightServiceThread);
+  return mismatch;
+}
+
+// libusb and the hotplug callbacks; seeds the registry with the devices
+// already present. Service thread only.
+bool usbStart()
+{
+  if (!usbLoad()) {
+    return false;
+  }
+  if (g_libusb.init(&g_usbCtx) != LIBUSB_SUCCESS) {
+    g_monitorStatus.store("libusb failed to initialize", std::memory_order_relaxed);
+    g_usbCtx = NULL;
+    return false;
+  }
+
+  if (!g_libusb.has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    g_monitorStatus.store("hotplug not supported by this build of libusb", std::memory_order_relaxed);
+    g_libusb.exit(g_usbCtx);
+    g_usbCtx = NULL;
+    return false;
+  }
+
+  // enumerate the devices already present to seed the registry
+  g_usbEnumerating = true;
+  int rc = g_libusb.hotplug_register_callback(g_usbCtx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+                                             LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &g_hp[0]);
+  g_usbEnumerating = false;
+  if (LIBUSB_SUCCESS != rc) {
+    g_monitorStatus.store("error registering the libusb arrival callback", std::memory_order_relaxed);
+    g_libusb.exit(g_usbCtx);
+    g_usbCtx = NULL;
+    return false;
+  }
+
+  rc = g_libusb.hotplug_register_callback(g_usbCtx, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, (libusb_hotplug_flag)0, LIBUSB_HOTPLUG_MATCH_ANY,
+                                         LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &g_hp[1]);
+  if (LIBUSB_SUCCESS != rc) {
+    g_monitorStatus.store("error registering the libusb removal callback", std::memory_order_relaxed);
+    g_libusb.exit(g_usbCtx);
+    g_usbCtx = NULL;
+    return false;
+  }
+  g_usbSweep.activity();
+  g_usbRunning = true;
+  g_monitorStatus.store("libusb", std::memory_order_relaxed);
+  return true;
+}
+
+void usbStop()
+{
+  g_libusb.exit(g_usbCtx);
+  g_usbCtx = NULL;
+  g_usbDevices.clear();
+  g_usbRunning = false;
+}
+
+// Resolve libusb the first time it's needed after a load of the extension
+// (usbUnload() closes it again). Service thread only.
+bool usbLoad()
+{
+  if (g_libusb.handle) return true;
+
+  const auto start = std::chrono::steady_clock::now();
+  void *handle = dlopen("libusb-1.0.so.0", RTLD_NOW | RTLD_LOCAL);
+  if (!handle) handle = dlopen("libusb-1.0.so", RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    g_monitorStatus.store("libusb-1.0 not found", std::memory_order_relaxed);
+    return false;
+  }
+
+  bool resolved = true;
+#define LIBUSB_RESOLVE(name) \
+  resolved = resolved && (g_libusb.name = (decltype(g_libusb.name))dlsym(handle, "libusb_" #name)) != NULL;
+  LIBUSB_FUNCTIONS(LIBUSB_RESOLVE)
+#undef LIBUSB_RESOLVE
+  if (!resolved) {
+    g_monitorStatus.store("libusb-1.0 is missing functions (1.0.16+ needed)", std::memory_order_relaxed);
+    dlclose(handle);
+    return false;
+  }
+  g_libusb.handle = handle;
+  g_usbLoadMs.store(elapsedMs(start), std::memory_order_relaxed);
+  return true;
+}
+
+void usbUnload()
+{
+  if (g_libusb.handle) {
+    dlclose(g_libusb.handle);
+    g_libusb.handle = NULL;
+  }
+}
+
+// Watch /dev/snd for ALSA MIDI device nodes coming and going. Coarser than
+// libusb (no port counts, so every change waits out the full debounce) but
+// it needs nothing beyond the kernel.
+bool alsaStart()
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) return false;
+  if (inotify_add_watch(fd, "/dev/snd", IN_CREATE | IN_DELETE) < 0) {
+    close(fd);
+    return false;
+  }
+  g_alsaFd = fd;
+  const char *status = g_monitorStatus.load(std::memory_order_relaxed);
+  g_monitorStatus.store(status && !strcmp(status, "libusb-1.0 not found")
+    ? "ALSA device nodes (libusb-1.0 not found)" : "ALSA device nodes (no libusb)", std::memory_order_relaxed);
+  return true;
+}
+
+void alsaStop()
+{
+  if (g_alsaFd >= 0) {
+    close(g_alsaFd);
+    g_alsaFd = -1;
+  }
+}
+
+// The USB device behind a /dev/snd node, as usbIdentity() would name it, or
+// empty if it isn't a USB device. Resolved from sysfs when the node is
+// created and remembered for when it's deleted.
+static std::string alsaIdentity(const char *node, bool created)
+{
+  int card, device;
+  if (sscanf(node, "midiC%dD%d", &card, &device) != 2) return std::string();
+  if (!created) {
+    auto it = g_alsaCards.find(card);
+    return it != g_alsaCards.end() ? it->second : std::string();
+  }
+
+  std::string identity;
+  char resolved[PATH_MAX];
+  std::string link = std::string("/sys/class/sound/") + node + "/device";
+  if (realpath(link.c_str(), resolved)) {
+    // the card is a USB interface ("3-1.4:1.0"), the device is its parent
+    std::string dir(resolved);
+    for (int level = 0; level < 3 && !dir.empty(); ++level) {
+      unsigned vid, pid;
+      FILE *fpVid = fopen((dir + "/idVendor").c_str(), "r");
+      FILE *fpPid = fopen((dir + "/idProduct").c_str(), "r");
+      const bool found = fpVid && fpPid && fscanf(fpVid, "%x", &vid) == 1 && fscanf(fpPid, "%x", &pid) == 1;
+      if (fpVid) fclose(fpVid);
+      if (fpPid) fclose(fpPid);
+      if (found) {
+        identity = usbIdentity(dir.substr(dir.rfind('/') + 1).c_str(), (uint16_t)vid, (uint16_t)pid);
+        break;
+      }
+      dir.erase(dir.rfind('/'));
+    }
+  }
+  g_alsaCards[card] = identity;
+  return identity;
+}
+
+// service thread; waits up to 1ms for a change
+void alsaReceive()
+{
+  pollfd pfd = { g_alsaFd, POLLIN, 0 };
+  if (poll(&pfd, 1, 1) <= 0) return;
+
+  alignas(inotify_event) char buf[4096];
+  ssize_t len;
+  bool changed = false, first = false;
+  while ((len = read(g_alsaFd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + ((inotify_event *)p)->len) {
+      const inotify_event *event = (const inotify_event *)p;
+      if (event->len && !strncmp(event->name, "midi", 4)) {
+        // every node of a card reports the same device
+        const bool created = (event->mask & IN_CREATE) != 0;
+        const std::string identity = alsaIdentity(event->name, created);
+        DedupEntry *dedup;
+        first |= identity.empty() ? !dedupAnonymous() : dedupReport(identity, created, kSourceAlsa, &dedup);
+        changed = true;
+      }
+    }
+  }
+  if (!changed) return;
+
+  ++g_metrics.events[kSourceAlsa];
+  if (!first) return;
+  brokerPublish(kBrokerChanged, 0, 0, NULL, NULL);
+  g_expectedUnknown.store(true, std::memory_order_relaxed);
+  noteDeviceEvent();
+}
+
+// libusb if we can, the ALSA device nodes if not
+static bool monitorStart()
+{
+  return usbStart() || alsaStart();
+}
+
+// Keep the service thread's wakeups out of the way of REAPER's audio
+// threads: a background scheduling class, and optionally a CPU mask that
+// leaves isolated audio cores alone. Runs on the service thread itself.
+void configureServiceThread()
+{
+  pthread_setname_np(pthread_self(), "automidireset");
+
+  static const int policies[] = { SCHED_IDLE, SCHED_BATCH, SCHED_OTHER };
+  int policy = policies[std::min(std::max(g_settings.servicePolicy, 0), 2)];
+  sched_param param = {}; // all three need priority 0
+  pthread_setschedparam(pthread_self(), policy, &param);
+
+  if (g_settings.serviceCpus) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < 64 && i < CPU_SETSIZE; ++i) {
+      if (g_settings.serviceCpus >> i & 1) CPU_SET(i, &cpus);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+}
+
+void serviceThread()
+{
+  configureServiceThread();
+  if (g_settings.broker) {
+    brokerOpen();
+  }
+  if (g_broker.role != kBrokerSubscriber && !monitorStart()) {
+    brokerClose(); // let another instance monitor
+  }
+
+  timeval tv;
+  ResumeDetector resume = {};
+  while (g_usbInited.load(std::memory_order_relaxed)) {
+    if (int64_t suspendedMs = resume.check(suspendClockOffsetMs())) {
+      g_resumeDetectedMs.store(suspendedMs, std::memory_order_relaxed); // the timer notices on its next tick
+      g_usbSweep.activity(); // catch whatever re-enumerated while asleep
+    }
+    if (g_broker.role == kBrokerSubscriber) {
+      brokerReceive(); // waits up to 1ms for the owner
+      continue;
+    }
+    if (g_usbRunning) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 500;
+      g_libusb.handle_events_timeout(g_usbCtx, &tv);
+      if (g_usbSweep.due() && usb_sweep()) {
+        g_usbSweep.activity();
+      }
+    }
+    else if (g_alsaFd >= 0) {
+      alsaReceive();
+    }
+    else { // no monitor at all
+      std::this_thread::sleep_for(std::chrono::milliseconds(BROKER_RETRY_MS));
+      continue;
+    }
+    if (g_broker.role == kBrokerOwner) {
+      brokerServe();
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+}
+
+static void brokerAddress(sockaddr_un *addr, socklen_t *len)
+{
+  // abstract namespace: nothing to clean up if the owner crashes
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int nameLen = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "sockmonkey72_automidireset.%u", (unsigned)getuid());
+  *len = (socklen_t)(offsetof(sockaddr_un, sun_path) + 1 + nameLen);
+}
+
+// true if the process at the other end of fd runs as our user
+static bool brokerPeerTrusted(int fd)
+{
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == getuid()) return true;
+
+  ++g_broker.rejected;
+  return false;
+}
+
+// Binds the broker socket (owner) or else connects to it (subscriber).
+// Leaves role at kBrokerOff if neither works, with foreignOwner set if
+// another user holds the name.
+bool brokerOpen()
+{
+  sockaddr_un addr;
+  socklen_t len;
+  brokerAddress(&addr, &len);
+  g_broker.foreignOwner = false;
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  if (!bind(fd, (sockaddr *)&addr, len) && !listen(fd, 8)) {
+    g_broker.fd = fd;
+    g_broker.role = kBrokerOwner;
+    return true;
+  }
+  close(fd);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0); // blocking connect, local and immediate
+  if (fd < 0) return false;
+  if (!connect(fd, (sockaddr *)&addr, len)) {
+    if (!brokerPeerTrusted(fd)) {
+      close(fd);
+      g_broker.foreignOwner = true;
+      return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    g_broker.fd = fd;
+    g_broker.role = kBrokerSubscriber;
+    return true;
+  }
+  close(fd);
+  return false;
+}
+
+void brokerClose()
+{
+  for (int fd : g_broker.subscribers) {
+    close(fd);
+  }
+  g_broker.subscribers.clear();
+  g_broker.numSubscribers = 0;
+  if (g_broker.role != kBrokerOff) {
+    close(g_broker.fd);
+    g_broker.role = kBrokerOff;
+  }
+}
+
+// forward a registry change to the subscribers; service thread, owner only
+void brokerPublish(BrokerEventType type, uint16_t vid, uint16_t pid, const midi_port_counts *counts, const char *path)
+{
+  if (g_broker.role != kBrokerOwner || g_broker.subscribers.empty()) return;
+
+  BrokerEvent event = {};
+  event.magic = BROKER_MAGIC;
+  event.type = (uint8_t)type;
+  event.vid = vid;
+  event.pid = pid;
+  if (counts) {
+    event.inputs = (int16_t)counts->inputs;
+    event.outputs = (int16_t)counts->outputs;
+  }
+  if (path) {
+    snprintf(event.path, sizeof(event.path), "%s", path);
+  }
+
+  for (auto it = g_broker.subscribers.begin(); it != g_broker.subscribers.end();) {
+    if (send(*it, &event, sizeof(event), MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)sizeof(event)) {
+      ++it;
+      continue;
+    }
+    close(*it); // gone, or too far behind to be trusted
+    it = g_broker.subscribers.erase(it);
+  }
+  g_broker.numSubscribers = (int)g_broker.subscribers.size();
+}
+
+// accept new subscribers; service thread, owner only
+void brokerServe()
+{
+  int fd;
+  while ((fd = accept4(g_broker.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    if (brokerPeerTrusted(fd)) g_broker.subscribers.push_back(fd);
+    else close(fd);
+  }
+  g_broker.numSubscribers = (int)g_broker.subscribers.size();
+}
+
+static void brokerApply(const BrokerEvent &event)
+{
+  ++g_metrics.events[kSourceBroker];
+  if (event.type == kBrokerChanged) {
+    g_expectedUnknown.store(true, std::memory_order_relaxed);
+    noteDeviceEvent();
+    return;
+  }
+  // the owner publishes every MIDI device; our own rules apply, not the owner's
+  if (!usbDeviceAllowed(event.vid, event.pid, event.path)) {
+    ++g_metrics.excludedEvents;
+    return;
+  }
+  if (event.type == kBrokerLeft) {
+    g_expectedUnknown.store(true, std::memory_order_relaxed); // REAPER keeps the slots of removed ports around
+    noteDeviceEvent();
+    return;
+  }
+  if (event.inputs || event.outputs) {
+    g_expectedInputs.fetch_add(event.inputs, std::memory_order_relaxed);
+    g_expectedOutputs.fetch_add(event.outputs, std::memory_order_relaxed);
+  }
+  else {
+    g_expectedUnknown.store(true, std::memory_order_relaxed);
+  }
+  noteDeviceEvent();
+}
+
+// read the owner's events, or take over once it has gone; service thread, subscriber only
+void brokerReceive()
+{
+  pollfd pfd = { g_broker.fd, POLLIN, 0 };
+  if (poll(&pfd, 1, 1) <= 0) return;
+
+  BrokerEvent event;
+  ssize_t received;
+  while ((received = recv(g_broker.fd, &event, sizeof(event), 0)) == (ssize_t)sizeof(event)) {
+    if (event.magic == BROKER_MAGIC) {
+      event.path[sizeof(event.path) - 1] = '\0';
+      brokerApply(event);
+    }
+  }
+  if (received < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+  // the owner exited: whoever binds first monitors for everyone
+  close(g_broker.fd);
+  g_broker.role = kBrokerOff;
+  ++g_broker.failovers;
+  while (g_usbInited.load(std::memory_order_relaxed)) {
+    if (brokerOpen() || g_broker.foreignOwner) {
+      if (g_broker.role != kBrokerSubscriber && !monitorStart()) {
+        brokerClose(); // let someone else try, this instance stays without a monitor
+      }
+      // devices that came or went between the old owner's exit and now were
+      // never forwarded, and a new monitor's enumeration only seeds the
+      // registry: reconcile against whatever is there now
+      g_expectedUnknown.store(true, std::memory_order_relaxed);
+      noteDeviceEvent();
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(BROKER_RETRY_MS));
+  }
+}
+
 #else // __APPLE__
 
 static void notifyProc(const MIDINotification *message, void *refCon)
 {
+  if (message) {
+    flightRecord(kFlightNotify, kFlightMainThread, message->messageID); // delivered on the client's run loop
+    ++g_metrics.events[kSourceCoreMIDI];
+    g_sweep.schedule.activity();
+  }
   if (message && message->messageID == 1) {
-    g_eventReceived = true;
+    noteDeviceEvent();
   }
 }
 
@@ -586,6 +4314,11 @@ static bool loadAPI(void *(*getFunc)(const char *))
     OPTIONAL_API(midi_init),
     REQUIRED_API(midi_reinit),
     REQUIRED_API(plugin_register),
+    OPTIONAL_API(GetResourcePath),
+    OPTIONAL_API(GetExtState),
+    OPTIONAL_API(GetPlayState),
+    OPTIONAL_API(get_ini_file),
+    OPTIONAL_API(MIDI_GetRecentInputEvent),
   };
 
   for (const ApiFunc &func : funcs) {
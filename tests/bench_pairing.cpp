@@ -0,0 +1,96 @@
+// A studio rig of USB MIDI devices (one input and one output each) behind a
+// hub that is power cycled: every device drops off, then comes back, and
+// each time a midi_reinit and a full reconcile follow. Runs against a
+// stand-in for REAPER whose midi_init costs a fixed amount per call plus a
+// little per port opened, and compares "pair_ports" off and on: the
+// midi_init calls and the reconcile time, per hub cycle.
+//
+//   bench_pairing [devices] [cycles] [us per midi_init] [us per port]
+
+#include "../reaper_automidireset.cpp"
+
+static int g_numDevices;
+static std::vector<bool> g_plugged; // by device, also its slot in both directions
+static int g_callUs;
+static int g_portUs;
+static uint64_t g_inits;
+
+static int fakeGetNumMIDIPorts() { return g_numDevices; }
+
+static bool fakePortName(int dev, bool output, char *nameout, int nameout_sz)
+{
+  if (dev < 0 || dev >= g_numDevices) return false;
+  snprintf(nameout, nameout_sz, "Rig Device %d %s", dev + 1, output ? "Out" : "In");
+  return g_plugged[dev];
+}
+
+static bool fakeGetMIDIInputName(int dev, char *nameout, int nameout_sz) { return fakePortName(dev, false, nameout, nameout_sz); }
+static bool fakeGetMIDIOutputName(int dev, char *nameout, int nameout_sz) { return fakePortName(dev, true, nameout, nameout_sz); }
+
+// REAPER goes through its device lists on each call, then opens the ports
+static void fakeMidiInit(int force_reinit_input, int force_reinit_output)
+{
+  ++g_inits;
+  const int ports = (force_reinit_input >= 0) + (force_reinit_output >= 0);
+  std::this_thread::sleep_for(std::chrono::microseconds(g_callUs + ports * g_portUs));
+}
+
+static void fakeMidiReinit() {}
+
+struct RigResult {
+  uint64_t inits[2]; // unplug, replug
+  double ms[2];
+};
+
+static void hubCycles(bool pair, int cycles, RigResult *result)
+{
+  g_settings.pairPorts = pair;
+  g_plugged.assign(g_numDevices, true);
+  g_reconcile.active = false;
+  initLists();
+  *result = RigResult {};
+
+  for (int cycle = 0; cycle < cycles; ++cycle) {
+    for (int replug = 0; replug < 2; ++replug) {
+      g_plugged.assign(g_numDevices, replug != 0);
+      const uint64_t inits = g_inits;
+      const auto start = std::chrono::steady_clock::now();
+      fullReinit();
+      while (!reconcileStep(-1)) {}
+      result->ms[replug] += elapsedMs(start);
+      result->inits[replug] += g_inits - inits;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  g_numDevices = argc > 1 ? atoi(argv[1]) : 32;
+  const int cycles = argc > 2 ? atoi(argv[2]) : 5;
+  g_callUs = argc > 3 ? atoi(argv[3]) : 2000;
+  g_portUs = argc > 4 ? atoi(argv[4]) : 500;
+
+  GetNumMIDIInputs = fakeGetNumMIDIPorts;
+  GetNumMIDIOutputs = fakeGetNumMIDIPorts;
+  GetMIDIInputName = fakeGetMIDIInputName;
+  GetMIDIOutputName = fakeGetMIDIOutputName;
+  midi_init = fakeMidiInit;
+  midi_reinit = fakeMidiReinit;
+
+  printf("%d devices, %d hub cycles, midi_init %d us + %d us per port\n", g_numDevices, cycles, g_callUs, g_portUs);
+  printf("%-8s %18s %18s %18s %18s\n", "pairing", "unplug midi_init", "unplug ms", "replug midi_init", "replug ms");
+  RigResult results[2];
+  for (int pair = 0; pair < 2; ++pair) {
+    hubCycles(pair != 0, cycles, &results[pair]);
+    printf("%-8s %18.1f %18.1f %18.1f %18.1f\n", pair ? "on" : "off",
+           (double)results[pair].inits[0] / cycles, results[pair].ms[0] / cycles,
+           (double)results[pair].inits[1] / cycles, results[pair].ms[1] / cycles);
+  }
+
+  if (results[1].inits[1] * 2 != results[0].inits[1]) {
+    fprintf(stderr, "FAIL pairing should halve the midi_init calls of a replug: %llu, %llu without\n",
+            (unsigned long long)results[1].inits[1], (unsigned long long)results[0].inits[1]);
+    return 1;
+  }
+  return 0;
+}
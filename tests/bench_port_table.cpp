@@ -0,0 +1,81 @@
+// Reader throughput of the port table while it's being republished: one
+// writer thread calls publishPortTable() with a list that changes every
+// time, the readers pin snapshots and check that each is whole. Prints
+// publishes and reads per second.
+//
+//   bench_port_table [readers] [seconds] [ports]
+
+#include "../reaper_automidireset.cpp"
+
+static std::atomic<bool> g_running;
+static std::atomic<uint64_t> g_publishes;
+static std::atomic<uint64_t> g_reads;
+static std::atomic<uint64_t> g_torn;
+
+// The owner of the lists: flip one port per publish, so that each snapshot
+// is new, and name the ports after the generation they appear in
+static void writerThread(int numPorts)
+{
+  inputsList.assign(numPorts, false);
+  outputsList.assign(numPorts, false);
+  g_portNames[0].assign(numPorts, std::string());
+  g_portNames[1].assign(numPorts, std::string());
+  uint64_t publishes = 0;
+  for (uint64_t n = 0; g_running.load(std::memory_order_relaxed); ++n) {
+    const int index = (int)(n % numPorts);
+    inputsList[index] = outputsList[index] = !inputsList[index];
+    const std::string stamp = std::to_string(g_portTable.generation + 1); // the generation this publish gets
+    for (int output = 0; output < 2; ++output) {
+      for (std::string &name : g_portNames[output]) name = stamp;
+    }
+    publishPortTable();
+    if (!g_portTable.dirty) ++publishes;
+  }
+  g_publishes = publishes;
+}
+
+static void readerThread()
+{
+  uint64_t reads = 0, torn = 0;
+  while (g_running.load(std::memory_order_relaxed)) {
+    PortTableReader reader;
+    const PortSnapshot &snapshot = reader.snapshot();
+    const std::string stamp = std::to_string(snapshot.generation);
+    for (int output = 0; output < 2; ++output) {
+      for (const PortState &port : snapshot.ports[output]) {
+        if (snapshot.generation && port.name != stamp) ++torn;
+      }
+    }
+    ++reads;
+  }
+  g_reads += reads;
+  g_torn += torn;
+}
+
+int main(int argc, char **argv)
+{
+  const int numReaders = argc > 1 ? atoi(argv[1]) : 4;
+  const double seconds = argc > 2 ? atof(argv[2]) : 2.;
+  const int numPorts = argc > 3 ? atoi(argv[3]) : 16;
+
+  g_running = true;
+  std::vector<std::thread> readers;
+  for (int i = 0; i < numReaders; ++i) readers.emplace_back(readerThread);
+  std::thread writer(writerThread, numPorts);
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  g_running = false;
+  writer.join();
+  for (std::thread &reader : readers) reader.join();
+
+  printf("%d readers, %d ports per direction, %.1f s\n", numReaders, numPorts, seconds);
+  printf("publishes: %llu (%.0f/s), skipped with every spare slot pinned: %d\n",
+         (unsigned long long)g_publishes.load(), g_publishes / seconds, g_portTable.skipped);
+  printf("reads: %llu (%.0f/s, %.0f/s per reader)\n",
+         (unsigned long long)g_reads.load(), g_reads / seconds, g_reads / seconds / numReaders);
+  if (g_torn) {
+    fprintf(stderr, "FAIL %llu ports read from a snapshot being written\n", (unsigned long long)g_torn.load());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Wakeup jitter of a real-time thread, standing in for REAPER's audio
+// thread, while busy threads set up by configureServiceThread() compete for
+// the same CPU under each "service_policy": SCHED_IDLE, SCHED_BATCH and
+// SCHED_OTHER. The real-time thread asks for SCHED_FIFO and falls back to
+// SCHED_OTHER without the privilege; either way it sleeps to a 1 ms grid
+// and records how late it wakes. Prints the lateness per policy.
+//
+//   bench_service_jitter [seconds per policy] [busy threads]
+
+#include "../reaper_automidireset.cpp"
+
+#define PERIOD_US 1000
+#define BENCH_CPU 0
+
+static std::atomic<bool> g_running;
+static std::atomic<int> g_busyReady;
+
+static void pinToBenchCpu()
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(BENCH_CPU, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// the service thread with a lot more to do than usual
+static void busyThread()
+{
+  configureServiceThread();
+  ++g_busyReady;
+  volatile uint64_t sink = 0;
+  while (g_running.load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 10000; ++i) sink = sink + i;
+  }
+}
+
+struct Lateness {
+  std::vector<double> us;
+  bool fifo;
+};
+
+static void rtThread(double seconds, Lateness *lateness)
+{
+  pinToBenchCpu();
+  sched_param param = {};
+  param.sched_priority = std::min(sched_get_priority_max(SCHED_FIFO), 70);
+  lateness->fifo = !pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  const int wakeups = (int)(seconds * 1000000 / PERIOD_US);
+  lateness->us.reserve(wakeups);
+  for (int i = 0; i < wakeups; ++i) {
+    next.tv_nsec += PERIOD_US * 1000;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_nsec -= 1000000000;
+      ++next.tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lateness->us.push_back(((now.tv_sec - next.tv_sec) * 1000000000. + (now.tv_nsec - next.tv_nsec)) / 1000.);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const double seconds = argc > 1 ? atof(argv[1]) : 3.;
+  const int numBusy = argc > 2 ? atoi(argv[2]) : 2;
+
+  static const char * const policyNames[] = { "SCHED_IDLE", "SCHED_BATCH", "SCHED_OTHER" };
+  g_settings.serviceCpus = 1ull << BENCH_CPU; // all on one CPU, so that they compete
+
+  printf("%d busy threads on CPU %d, %.1f s per policy, %d us period\n", numBusy, BENCH_CPU, seconds, PERIOD_US);
+  printf("%-12s %10s %10s %10s %10s\n", "service", "avg us", "p99 us", "p99.9 us", "max us");
+  bool fifo = true;
+  for (int policy = 0; policy < 3; ++policy) {
+    g_settings.servicePolicy = policy;
+    g_running = true;
+    g_busyReady = 0;
+    std::vector<std::thread> busy;
+    for (int i = 0; i < numBusy; ++i) busy.emplace_back(busyThread);
+    while (g_busyReady < numBusy) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Lateness lateness;
+    std::thread rt(rtThread, seconds, &lateness);
+    rt.join();
+    g_running = false;
+    for (std::thread &thread : busy) thread.join();
+
+    fifo = fifo && lateness.fifo;
+    std::vector<double> &us = lateness.us;
+    std::sort(us.begin(), us.end());
+    double total = 0.;
+    for (double value : us) total += value;
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f\n", policyNames[policy], total / us.size(),
+           us[us.size() * 99 / 100], us[us.size() * 999 / 1000], us.back());
+  }
+  if (!fifo) {
+    printf("(no SCHED_FIFO here: the real-time thread ran as SCHED_OTHER)\n");
+  }
+  return 0;
+}
@@ -0,0 +1,267 @@
+// Loads and unloads the plugin over and over against a stand-in for
+// REAPER's API, while device threads hand off events the way the service
+// thread does and reader threads read the port table and the statistics the
+// way scripts and the actions do. Built with ThreadSanitizer
+// (-DAUTOMIDIRESET_TSAN_STRESS=ON), which reports any data race in the
+// handoffs; prints the throughput of each side at the end.
+//
+//   stress_handoff [rounds] [round ms]
+
+#include "../reaper_automidireset.cpp"
+
+#include <mutex>
+#include <random>
+
+#define NUM_DEVICES 8 // one input and one output each, at the slot of the same index
+
+// The OS side, changed by the device threads
+static std::mutex g_deviceMutex;
+static bool g_plugged[NUM_DEVICES];
+
+// REAPER's side, main thread only
+static int g_numSlots;
+static std::vector<void *> g_timers;
+static int g_nextCommand = 1000;
+static std::string g_resourcePath;
+static std::string g_iniPath;
+
+static std::atomic<bool> g_running;
+static std::atomic<uint64_t> g_eventsSent;
+static std::atomic<uint64_t> g_portReads;
+static std::atomic<uint64_t> g_statusReads;
+static std::atomic<int> g_failures;
+static uint64_t g_notifications; // main thread only
+static uint64_t g_reinits;
+static uint64_t g_inits;
+
+static bool plugged(int device)
+{
+  std::lock_guard<std::mutex> lock(g_deviceMutex);
+  return g_plugged[device];
+}
+
+static void fakeShowConsoleMsg(const char *msg) {}
+static int fakeGetNumMIDIInputs() { return g_numSlots; }
+static int fakeGetNumMIDIOutputs() { return g_numSlots; }
+
+static bool fakePortName(int dev, char *nameout, int nameout_sz)
+{
+  if (dev < 0 || dev >= g_numSlots) return false;
+  snprintf(nameout, nameout_sz, "Stress Device %d", dev);
+  return plugged(dev);
+}
+
+static bool fakeGetMIDIInputName(int dev, char *nameout, int nameout_sz) { return fakePortName(dev, nameout, nameout_sz); }
+static bool fakeGetMIDIOutputName(int dev, char *nameout, int nameout_sz) { return fakePortName(dev, nameout, nameout_sz); }
+static void fakeMidiInit(int force_reinit_input, int force_reinit_output) { ++g_inits; }
+
+// REAPER only adds slots here
+static void fakeMidiReinit()
+{
+  ++g_reinits;
+  for (int device = g_numSlots; device < NUM_DEVICES; ++device) {
+    if (plugged(device)) g_numSlots = device + 1;
+  }
+}
+
+static int fakePluginRegister(const char *name, void *infostruct)
+{
+  if (!strcmp(name, "timer")) {
+    if (std::find(g_timers.begin(), g_timers.end(), infostruct) == g_timers.end()) g_timers.push_back(infostruct);
+  }
+  else if (!strcmp(name, "-timer")) {
+    g_timers.erase(std::remove(g_timers.begin(), g_timers.end(), infostruct), g_timers.end());
+  }
+  else if (!strcmp(name, "custom_action")) {
+    return g_nextCommand++;
+  }
+  return 1;
+}
+
+static const char *fakeGetResourcePath() { return g_resourcePath.c_str(); }
+
+static const char *fakeGetExtState(const char *section, const char *key)
+{
+  if (!strcmp(key, "flight_recorder_file")) return "1";
+  if (!strcmp(key, "metrics_interval_s")) return "0.1";
+  return "";
+}
+
+static int fakeGetPlayState() { return 0; }
+static const char *fakeGetIniFile() { return g_iniPath.c_str(); }
+static int fakeMIDI_GetRecentInputEvent(int idx, char *bufOut, int *bufOut_sz, int *tsOut, int *devIdxOut, double *projPosOut, int *projLoopCntOut) { return 0; }
+
+static void *fakeGetFunc(const char *name)
+{
+  static const std::pair<const char *, void *> funcs[] = {
+    { "ShowConsoleMsg", (void *)fakeShowConsoleMsg },
+    { "GetNumMIDIInputs", (void *)fakeGetNumMIDIInputs },
+    { "GetNumMIDIOutputs", (void *)fakeGetNumMIDIOutputs },
+    { "GetMIDIInputName", (void *)fakeGetMIDIInputName },
+    { "GetMIDIOutputName", (void *)fakeGetMIDIOutputName },
+    { "midi_init", (void *)fakeMidiInit },
+    { "midi_reinit", (void *)fakeMidiReinit },
+    { "plugin_register", (void *)fakePluginRegister },
+    { "GetResourcePath", (void *)fakeGetResourcePath },
+    { "GetExtState", (void *)fakeGetExtState },
+    { "GetPlayState", (void *)fakeGetPlayState },
+    { "get_ini_file", (void *)fakeGetIniFile },
+    { "MIDI_GetRecentInputEvent", (void *)fakeMIDI_GetRecentInputEvent },
+  };
+  for (const auto &func : funcs) {
+    if (!strcmp(name, func.first)) return func.second;
+  }
+  return NULL;
+}
+
+// Bursts of plugs and unplugs, what hotplug_callback() and brokerApply()
+// hand over, then quiet long enough for the debounce to settle (1.5 s after
+// an unplug or a new device).
+#define BURST_PERIOD_MS 2000
+#define BURST_MS 300
+
+static std::chrono::steady_clock::time_point g_start;
+
+static void deviceThread(unsigned seed)
+{
+  std::mt19937 random(seed);
+  while (g_running.load(std::memory_order_relaxed)) {
+    const int phase = (int)elapsedMs(g_start) % BURST_PERIOD_MS;
+    if (phase >= BURST_MS) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min(BURST_PERIOD_MS - phase, 50)));
+      continue;
+    }
+    const int device = random() % NUM_DEVICES;
+    bool nowPlugged;
+    {
+      std::lock_guard<std::mutex> lock(g_deviceMutex);
+      nowPlugged = g_plugged[device] = !g_plugged[device];
+    }
+    if (nowPlugged) {
+      g_expectedInputs.fetch_add(1, std::memory_order_relaxed);
+      g_expectedOutputs.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+      g_expectedUnknown.store(true, std::memory_order_relaxed);
+    }
+    noteDeviceEvent();
+    ++g_eventsSent;
+    std::this_thread::sleep_for(std::chrono::microseconds(random() % 2000));
+  }
+}
+
+// What scripts and the actions read from other threads
+static void readerThread()
+{
+  uint64_t lastGeneration = 0;
+  std::vector<char> buf(64 * 1024);
+  while (g_running.load(std::memory_order_relaxed)) {
+    {
+      PortTableReader reader;
+      const PortSnapshot &snapshot = reader.snapshot();
+      if (snapshot.generation < lastGeneration || snapshot.ports[0].size() != snapshot.ports[1].size()) {
+        fprintf(stderr, "FAIL inconsistent port table: generation %llu after %llu, %d inputs, %d outputs\n",
+                (unsigned long long)snapshot.generation, (unsigned long long)lastGeneration,
+                (int)snapshot.ports[0].size(), (int)snapshot.ports[1].size());
+        ++g_failures;
+      }
+      lastGeneration = snapshot.generation;
+    }
+    int generation;
+    AutoMIDIReset_GetPorts(buf.data(), (int)buf.size(), &generation);
+    g_portReads += 2;
+
+    std::string stats;
+    double events = 0.;
+    {
+      StatusReader reader; // what AutoMIDIReset_GetMetric() reads on Windows
+      stats = reader.snapshot().stats;
+      findMetric(reader.snapshot().metrics, "events", &events);
+    }
+    ++g_statusReads;
+  }
+}
+
+static void subscriber(const AutoMIDIReset_PortChange *changes, int numChanges, void *userData)
+{
+  for (int i = 0; i < numChanges; ++i) {
+    const AutoMIDIReset_PortChange *change = AUTOMIDIRESET_PORT_CHANGE(changes, i);
+    if (change->size != (int)sizeof(AutoMIDIReset_PortChange) || change->change > AutoMIDIReset_PortReinited || !change->name) {
+      fprintf(stderr, "FAIL malformed port change %d of %d\n", i, numChanges);
+      ++g_failures;
+    }
+  }
+  g_notifications += numChanges;
+}
+
+int main(int argc, char **argv)
+{
+  const int rounds = argc > 1 ? atoi(argv[1]) : 6;
+  const int roundMs = argc > 2 ? atoi(argv[2]) : 4000;
+
+  char dir[] = "/tmp/automidireset-stress.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  g_resourcePath = dir;
+  g_iniPath = g_resourcePath + "/reaper.ini";
+
+  reaper_plugin_info_t rec = {};
+  rec.caller_version = REAPER_PLUGIN_VERSION;
+  rec.Register = fakePluginRegister;
+  rec.GetFunc = fakeGetFunc;
+
+  g_start = std::chrono::steady_clock::now();
+  g_running = true;
+  std::vector<std::thread> threads;
+  threads.emplace_back(deviceThread, 1);
+  threads.emplace_back(deviceThread, 2);
+  threads.emplace_back(readerThread);
+  threads.emplace_back(readerThread);
+
+  const auto start = g_start;
+  for (int round = 0; round < rounds; ++round) {
+    if (!ReaperPluginEntry(NULL, &rec)) {
+      fprintf(stderr, "FAIL load %d\n", round);
+      ++g_failures;
+      break;
+    }
+    AutoMIDIReset_Subscribe(subscriber, NULL);
+    const auto roundStart = std::chrono::steady_clock::now();
+    for (int tick = 0; elapsedMs(roundStart) < roundMs; ++tick) {
+      const std::vector<void *> timers(g_timers); // a timer may unregister itself
+      for (void *timer : timers) ((void (*)())timer)();
+      if (tick % 500 == 0) showInfo(NULL, commandId, 0, 0, 0, NULL);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    AutoMIDIReset_Unsubscribe(subscriber, NULL);
+    ReaperPluginEntry(NULL, NULL);
+    if (!g_timers.empty()) {
+      fprintf(stderr, "FAIL %d timers still registered after unload %d\n", (int)g_timers.size(), round);
+      ++g_failures;
+      g_timers.clear();
+    }
+  }
+  g_running = false;
+  for (std::thread &thread : threads) thread.join();
+
+  const double seconds = elapsedMs(start) / 1000.;
+  printf("%d load/unload rounds in %.1f s\n", rounds, seconds);
+  printf("device events handed off: %llu (%.0f/s), %llu debounces, %llu coalesced\n",
+         (unsigned long long)g_eventsSent.load(), g_eventsSent / seconds,
+         (unsigned long long)g_metrics.debounceCount, (unsigned long long)g_metrics.coalescedEvents.load());
+  printf("reconciles: %d, midi_reinit %llu, midi_init %llu, port changes delivered %llu\n",
+         g_reconcileStats.count, (unsigned long long)g_reinits, (unsigned long long)g_inits, (unsigned long long)g_notifications);
+  printf("port table reads: %llu (%.0f/s), status reads: %llu (%.0f/s)\n",
+         (unsigned long long)g_portReads.load(), g_portReads / seconds,
+         (unsigned long long)g_statusReads.load(), g_statusReads / seconds);
+
+  if (!g_reconcileStats.count || !g_notifications) {
+    fprintf(stderr, "FAIL no device change made it through\n");
+    ++g_failures;
+  }
+  std::string cleanup = "rm -rf " + g_resourcePath;
+  if (system(cleanup.c_str())) {}
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+// The parts of libusb-1.0's libusb.h that reaper_automidireset.cpp uses,
+// with the same layouts, so that the test programs build without the
+// library's headers. Nothing is linked: the plugin resolves libusb with
+// dlopen() at runtime, and the tests fill in g_libusb themselves.
+
+#pragma once
+
+#include <cstdint>
+#include <sys/time.h>
+#include <sys/types.h>
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef int libusb_hotplug_callback_handle;
+
+enum libusb_error { LIBUSB_SUCCESS = 0 };
+enum libusb_capability { LIBUSB_CAP_HAS_HOTPLUG = 0x0001 };
+enum libusb_class_code { LIBUSB_CLASS_AUDIO = 1 };
+
+typedef enum {
+  LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 0x01,
+  LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT = 0x02
+} libusb_hotplug_event;
+
+typedef enum {
+  LIBUSB_HOTPLUG_ENUMERATE = 1 << 0
+} libusb_hotplug_flag;
+
+#define LIBUSB_HOTPLUG_MATCH_ANY -1
+
+struct libusb_device_descriptor {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bcdUSB;
+  uint8_t bDeviceClass;
+  uint8_t bDeviceSubClass;
+  uint8_t bDeviceProtocol;
+  uint8_t bMaxPacketSize0;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint16_t bcdDevice;
+  uint8_t iManufacturer;
+  uint8_t iProduct;
+  uint8_t iSerialNumber;
+  uint8_t bNumConfigurations;
+};
+
+struct libusb_endpoint_descriptor {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bEndpointAddress;
+  uint8_t bmAttributes;
+  uint16_t wMaxPacketSize;
+  uint8_t bInterval;
+  uint8_t bRefresh;
+  uint8_t bSynchAddress;
+  const unsigned char *extra;
+  int extra_length;
+};
+
+struct libusb_interface_descriptor {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bInterfaceNumber;
+  uint8_t bAlternateSetting;
+  uint8_t bNumEndpoints;
+  uint8_t bInterfaceClass;
+  uint8_t bInterfaceSubClass;
+  uint8_t bInterfaceProtocol;
+  uint8_t iInterface;
+  const struct libusb_endpoint_descriptor *endpoint;
+  const unsigned char *extra;
+  int extra_length;
+};
+
+struct libusb_interface {
+  const struct libusb_interface_descriptor *altsetting;
+  int num_altsetting;
+};
+
+struct libusb_config_descriptor {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t wTotalLength;
+  uint8_t bNumInterfaces;
+  uint8_t bConfigurationValue;
+  uint8_t iConfiguration;
+  uint8_t bmAttributes;
+  uint8_t MaxPower;
+  const struct libusb_interface *interface;
+  const unsigned char *extra;
+  int extra_length;
+};
+
+typedef int (*libusb_hotplug_callback_fn)(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+int libusb_has_capability(uint32_t capability);
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+                                     libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *callback_handle);
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv);
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref_devices);
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc);
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index, struct libusb_config_descriptor **config);
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config);
+uint8_t libusb_get_bus_number(libusb_device *dev);
+uint8_t libusb_get_device_address(libusb_device *dev);
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len);
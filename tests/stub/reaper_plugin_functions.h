@@ -0,0 +1,44 @@
+// Stand-in for the SDK's reaper_plugin.h and reaper_plugin_functions.h,
+// just enough to build reaper_automidireset.cpp into the test programs.
+// The API pointers are defined here, as REAPERAPI_IMPLEMENT does, and the
+// tests hand their own implementations to the plugin through GetFunc.
+
+#pragma once
+
+#include <cstdint>
+
+typedef void *HWND;
+typedef void *REAPER_PLUGIN_HINSTANCE;
+struct KbdSectionInfo;
+
+#define REAPER_PLUGIN_VERSION 0x20E
+#define REAPER_PLUGIN_DLL_EXPORT __attribute__((visibility("default")))
+#define REAPER_PLUGIN_ENTRYPOINT ReaperPluginEntry
+
+struct reaper_plugin_info_t {
+  int caller_version;
+  HWND hwnd_main;
+  int (*Register)(const char *name, void *infostruct);
+  void *(*GetFunc)(const char *name);
+};
+
+struct custom_action_register_t {
+  int uniqueSectionId;
+  const char *idStr;
+  const char *name;
+  void *extra;
+};
+
+void (*ShowConsoleMsg)(const char *msg);
+int (*GetNumMIDIInputs)();
+int (*GetNumMIDIOutputs)();
+bool (*GetMIDIInputName)(int dev, char *nameout, int nameout_sz);
+bool (*GetMIDIOutputName)(int dev, char *nameout, int nameout_sz);
+void (*midi_init)(int force_reinit_input, int force_reinit_output);
+void (*midi_reinit)();
+int (*plugin_register)(const char *name, void *infostruct);
+const char *(*GetResourcePath)();
+const char *(*GetExtState)(const char *section, const char *key);
+int (*GetPlayState)();
+const char *(*get_ini_file)();
+int (*MIDI_GetRecentInputEvent)(int idx, char *bufOut, int *bufOut_sz, int *tsOut, int *devIdxOut, double *projPosOut, int *projLoopCntOut);
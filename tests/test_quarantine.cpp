@@ -0,0 +1,143 @@
+// The reinit after a device change while a quarantined device is attached:
+// reinitForDeviceChange() stands in a reconcile of the known slots for the
+// midi_reinit, unless a device arrived that REAPER has no slot for yet.
+// Runs against a stand-in for REAPER's port functions.
+
+#include "../reaper_automidireset.cpp"
+
+// Ports by slot, the same for inputs and outputs. REAPER keeps a slot (and
+// its name) once it has seen the device, and only midi_reinit adds slots.
+struct FakePort {
+  const char *name;
+  bool present;
+};
+
+static FakePort g_ports[] = {
+  { "Slow Synth", true },  // opens slowly, quarantined
+  { "Pad Box", false },    // known, unplugged
+  { "New Keys", false },   // never seen, no slot
+};
+#define NUM_PORTS (int)(sizeof(g_ports) / sizeof(g_ports[0]))
+
+static int g_numSlots;
+static int g_reinits;
+static std::vector<int> g_initedPorts;
+
+static int fakeGetNumMIDIPorts() { return g_numSlots; }
+
+static bool fakeGetMIDIPortName(int dev, char *nameout, int nameout_sz)
+{
+  if (dev < 0 || dev >= g_numSlots) return false;
+  snprintf(nameout, nameout_sz, "%s", g_ports[dev].name);
+  return g_ports[dev].present;
+}
+
+static void fakeMidiInit(int force_reinit_input, int force_reinit_output)
+{
+  g_initedPorts.push_back(force_reinit_input >= 0 ? force_reinit_input : force_reinit_output);
+}
+
+static void fakeMidiReinit()
+{
+  ++g_reinits;
+  for (int i = g_numSlots; i < NUM_PORTS; ++i) {
+    if (g_ports[i].present) g_numSlots = i + 1;
+  }
+}
+
+// Slow Synth attached, Pad Box known but unplugged, New Keys unplugged
+static void reset()
+{
+  g_numSlots = 2;
+  g_ports[0].present = true;
+  g_ports[1].present = false;
+  g_ports[2].present = false;
+  g_reconcile.active = false;
+  initLists();
+  g_reinits = 0;
+  g_initedPorts.clear();
+}
+
+static void finishReconcile()
+{
+  for (int step = 0; step < 100 && !reconcileStep(-1); ++step) {}
+}
+
+static int g_failures;
+
+static void check(bool ok, const char *what)
+{
+  if (ok) {
+    printf("ok   %s\n", what);
+  }
+  else {
+    fprintf(stderr, "FAIL %s\n", what);
+    ++g_failures;
+  }
+}
+
+int main()
+{
+  GetNumMIDIInputs = fakeGetNumMIDIPorts;
+  GetNumMIDIOutputs = fakeGetNumMIDIPorts;
+  GetMIDIInputName = fakeGetMIDIPortName;
+  GetMIDIOutputName = fakeGetMIDIPortName;
+  midi_init = fakeMidiInit;
+  midi_reinit = fakeMidiReinit;
+
+  g_settings.quarantineMs = 100.;
+  OpenCost &cost = g_openCosts[portNameStem("Slow Synth")];
+  cost.avgMs = cost.maxMs = 400.;
+  cost.count = QUARANTINE_MIN_SAMPLES;
+
+  {
+    reset();
+    g_ports[1].present = true;
+    const int present[2] = { 2, 2 };
+    check(!unslottedPorts(present), "known slot replugged: no unslotted ports");
+    reinitForDeviceChange(unslottedPorts(present));
+    finishReconcile();
+    check(!g_reinits, "known slot replugged: no midi_reinit");
+    check(inputsList.size() == 2 && inputsList[1] && outputsList[1], "known slot replugged: attached");
+    check(std::find(g_initedPorts.begin(), g_initedPorts.end(), 0) == g_initedPorts.end(), "known slot replugged: quarantined device left open");
+  }
+
+  {
+    reset();
+    g_ports[2].present = true;
+    const int present[2] = { 2, 2 };
+    reinitForDeviceChange(unslottedPorts(present));
+    finishReconcile();
+    check(g_reinits == 1 && inputsList.size() == 3 && inputsList[2], "new device alone: found by the reconcile, midi_reinit");
+  }
+
+  {
+    reset();
+    g_ports[1].present = true;
+    g_ports[2].present = true;
+    const int present[2] = { 3, 3 };
+    check(unslottedPorts(present), "new device with a known slot replugged: unslotted ports");
+    reinitForDeviceChange(unslottedPorts(present));
+    finishReconcile();
+    check(g_reinits == 1, "new device with a known slot replugged: midi_reinit");
+    check(inputsList.size() == 3 && inputsList[1] && inputsList[2] && outputsList[1] && outputsList[2],
+          "new device with a known slot replugged: both attached");
+  }
+
+  {
+    // the same on Linux, where the device events announce their port counts
+    reset();
+    g_ports[1].present = true;
+    g_ports[2].present = true;
+    g_expectedInputs = 2;
+    g_expectedOutputs = 2;
+    check(!expectedPortsReady(), "announced ports beyond the known slots: not ready without midi_reinit");
+    g_expectedInputs = 1;
+    g_expectedOutputs = 1;
+    check(expectedPortsReady(), "announced ports in the known slots: ready");
+    g_expectedInputs = 0;
+    g_expectedOutputs = 0;
+  }
+
+  return g_failures ? 1 : 0;
+}
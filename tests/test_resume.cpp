@@ -0,0 +1,58 @@
+// Suspend/resume handling: ResumeDetector::check() fed CLOCK_BOOTTIME -
+// CLOCK_MONOTONIC offsets as suspendClockOffsetMs() would return them, and
+// the debounce in and out of resume mode.
+
+#include "../reaper_automidireset.cpp"
+
+static int g_failures;
+
+static void check(bool ok, const char *what)
+{
+  if (ok) {
+    printf("ok   %s\n", what);
+  }
+  else {
+    fprintf(stderr, "FAIL %s\n", what);
+    ++g_failures;
+  }
+}
+
+int main()
+{
+  {
+    ResumeDetector resume = {};
+    check(!resume.check(86400000), "first offset: only a baseline, however large");
+    check(!resume.check(86400000 + 3), "clock drift: no resume");
+    check(!resume.check(86400000 + 3 + RESUME_JUMP_MS - 1), "jump just under the threshold: no resume");
+    const int64_t base = 86400000 + 3 + RESUME_JUMP_MS - 1;
+    check(resume.check(base + 45000) == 45000, "45 s jump: resume, 45 s suspended");
+    check(!resume.check(base + 45000), "after a resume: the jump is the new baseline");
+    check(!resume.check(base + 40000), "offset going back: no resume");
+    check(resume.check(base + 40000 + RESUME_JUMP_MS) == RESUME_JUMP_MS, "jump at the threshold: resume");
+  }
+
+  {
+    check(!debounceSettled(1000), "normal debounce: not settled at 1 s");
+    check(debounceSettled(1501), "normal debounce: settled after 1.5 s");
+
+    beginResume(60000);
+    check(g_resume.active && g_resumeStats.count == 1, "resume mode entered");
+    check(takeDeviceEvent(), "resume starts the debounce");
+    check(!debounceSettled(1501), "resume mode: devices still re-enumerating at 1.5 s");
+    check(!debounceSettled(RESUME_QUIET_MS), "resume mode: not settled before the quiet period");
+    check(debounceSettled(RESUME_QUIET_MS + 1), "resume mode: settled after the quiet period");
+
+    const auto since = g_resume.since;
+    beginResume(2000); // woke up again before it settled
+    check(g_resume.since == since && g_resumeStats.count == 2, "second resume: same resume mode, counted");
+
+    g_resume.since = std::chrono::steady_clock::now() - std::chrono::milliseconds(RESUME_MAX_MS + 1);
+    check(debounceSettled(10), "resume mode: settled at the limit, however busy");
+
+    endResume();
+    check(!g_resume.active && g_resumeStats.lastSettleMs > RESUME_MAX_MS, "resume mode left, settle time kept");
+    check(!debounceSettled(1000) && debounceSettled(1501), "normal debounce again");
+  }
+
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+// libusb with another user in the same process: a control surface driver,
+// say, on the default context. A stand-in for libusb keeps the hotplug
+// callbacks and pending events per context, the way libusb does, and the
+// plugin must do all of its work on its own context: it never sees the
+// other user's events being handled, nor takes them away from it.
+
+#include "../reaper_automidireset.cpp"
+
+struct HotplugCallback {
+  int events;
+  libusb_hotplug_callback_fn fn;
+  void *userData;
+};
+
+struct libusb_context {
+  std::vector<HotplugCallback> callbacks;
+  std::vector<std::pair<libusb_device *, libusb_hotplug_event>> pending;
+};
+
+struct libusb_device {
+  uint8_t address;
+};
+
+static libusb_context g_defaultContext;
+static int g_defaultUsers; // libusb_init(NULL) without a libusb_exit(NULL)
+static std::vector<libusb_context *> g_contexts;
+static std::vector<libusb_device *> g_present;
+static std::vector<libusb_context *> g_listedContexts; // what get_device_list was called with
+
+static libusb_context *resolve(libusb_context *ctx) { return ctx ? ctx : &g_defaultContext; }
+
+static int fakeInit(libusb_context **ctx)
+{
+  if (!ctx) {
+    ++g_defaultUsers;
+    return LIBUSB_SUCCESS;
+  }
+  *ctx = new libusb_context();
+  g_contexts.push_back(*ctx);
+  return LIBUSB_SUCCESS;
+}
+
+static void fakeExit(libusb_context *ctx)
+{
+  if (!ctx) {
+    --g_defaultUsers;
+    return;
+  }
+  g_contexts.erase(std::remove(g_contexts.begin(), g_contexts.end(), ctx), g_contexts.end());
+  delete ctx;
+}
+
+static int fakeHasCapability(uint32_t capability) { return 1; }
+
+static int fakeHotplugRegisterCallback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+                                       libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *callback_handle)
+{
+  libusb_context *context = resolve(ctx);
+  context->callbacks.push_back(HotplugCallback { events, cb_fn, user_data });
+  *callback_handle = (int)context->callbacks.size();
+  if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
+    for (libusb_device *dev : g_present) cb_fn(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+  }
+  return LIBUSB_SUCCESS;
+}
+
+static int fakeHandleEventsTimeout(libusb_context *ctx, struct timeval *tv)
+{
+  libusb_context *context = resolve(ctx);
+  const auto pending = std::move(context->pending);
+  context->pending.clear();
+  for (const auto &event : pending) {
+    for (const HotplugCallback &callback : context->callbacks) {
+      if (callback.events & event.second) callback.fn(ctx, event.first, event.second, callback.userData);
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+static ssize_t fakeGetDeviceList(libusb_context *ctx, libusb_device ***list)
+{
+  g_listedContexts.push_back(ctx);
+  *list = new libusb_device *[g_present.size() + 1];
+  std::copy(g_present.begin(), g_present.end(), *list);
+  (*list)[g_present.size()] = NULL;
+  return (ssize_t)g_present.size();
+}
+
+static void fakeFreeDeviceList(libusb_device **list, int unref_devices) { delete[] list; }
+
+static int fakeGetDeviceDescriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+  *desc = libusb_device_descriptor {};
+  desc->idVendor = 0x0582;
+  desc->idProduct = dev->address;
+  desc->bNumConfigurations = 1;
+  return LIBUSB_SUCCESS;
+}
+
+// one MIDIStreaming interface, no jacks: a MIDI device with unknown port counts
+static const libusb_interface_descriptor g_midiStreaming = { 9, 4, 0, 0, 0, LIBUSB_CLASS_AUDIO, 3, 0, 0, NULL, NULL, 0 };
+static const libusb_interface g_interface = { &g_midiStreaming, 1 };
+
+static int fakeGetConfigDescriptor(libusb_device *dev, uint8_t config_index, struct libusb_config_descriptor **config)
+{
+  libusb_config_descriptor *desc = new libusb_config_descriptor();
+  desc->bNumInterfaces = 1;
+  desc->interface = &g_interface;
+  *config = desc;
+  return LIBUSB_SUCCESS;
+}
+
+static void fakeFreeConfigDescriptor(struct libusb_config_descriptor *config) { delete config; }
+static uint8_t fakeGetBusNumber(libusb_device *dev) { return 1; }
+static uint8_t fakeGetDeviceAddress(libusb_device *dev) { return dev->address; }
+
+static int fakeGetPortNumbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+  port_numbers[0] = dev->address;
+  return 1;
+}
+
+// every context that is up hears about it
+static void plug(libusb_device *dev)
+{
+  g_present.push_back(dev);
+  if (g_defaultUsers) g_defaultContext.pending.push_back({ dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED });
+  for (libusb_context *context : g_contexts) context->pending.push_back({ dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED });
+}
+
+// the other user: counts the arrivals it's told about
+static int g_surfaceArrivals;
+
+static int surfaceCallback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+  ++g_surfaceArrivals;
+  return 0;
+}
+
+static int g_failures;
+
+static void check(bool ok, const char *what)
+{
+  if (ok) {
+    printf("ok   %s\n", what);
+  }
+  else {
+    fprintf(stderr, "FAIL %s\n", what);
+    ++g_failures;
+  }
+}
+
+int main()
+{
+  g_libusb.handle = (void *)&g_libusb; // loaded, as far as usbLoad() is concerned
+  g_libusb.init = fakeInit;
+  g_libusb.exit = fakeExit;
+  g_libusb.has_capability = fakeHasCapability;
+  g_libusb.hotplug_register_callback = fakeHotplugRegisterCallback;
+  g_libusb.handle_events_timeout = fakeHandleEventsTimeout;
+  g_libusb.get_device_list = fakeGetDeviceList;
+  g_libusb.free_device_list = fakeFreeDeviceList;
+  g_libusb.get_device_descriptor = fakeGetDeviceDescriptor;
+  g_libusb.get_config_descriptor = fakeGetConfigDescriptor;
+  g_libusb.free_config_descriptor = fakeFreeConfigDescriptor;
+  g_libusb.get_bus_number = fakeGetBusNumber;
+  g_libusb.get_device_address = fakeGetDeviceAddress;
+  g_libusb.get_port_numbers = fakeGetPortNumbers;
+
+  libusb_device devices[] = { { 1 }, { 2 }, { 3 }, { 4 } };
+  timeval tv = { 0, 0 };
+
+  // the other user comes first, with a device already plugged in
+  g_libusb.init(NULL);
+  libusb_hotplug_callback_handle surfaceHandle;
+  g_libusb.hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+                                     LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, surfaceCallback, NULL, &surfaceHandle);
+  plug(&devices[0]);
+  g_libusb.handle_events_timeout(NULL, &tv);
+
+  check(usbStart(), "usbStart");
+  check(g_usbCtx && g_contexts.size() == 1 && g_contexts[0] == g_usbCtx, "own context");
+  check(g_defaultContext.callbacks.size() == 1, "no callbacks on the default context");
+  check(g_usbDevices.size() == 1 && !takeDeviceEvent(), "present device enumerated, no device event");
+
+  plug(&devices[1]);
+  g_libusb.handle_events_timeout(NULL, &tv);
+  check(g_surfaceArrivals == 2, "other user's events delivered to it");
+  check(g_usbDevices.size() == 1 && !takeDeviceEvent(), "other user's event handling doesn't reach the plugin");
+  g_libusb.handle_events_timeout(g_usbCtx, &tv);
+  check(g_usbDevices.size() == 2 && takeDeviceEvent(), "plugin's own event handling delivers the arrival");
+
+  plug(&devices[2]);
+  g_libusb.handle_events_timeout(g_usbCtx, &tv);
+  g_libusb.handle_events_timeout(NULL, &tv);
+  check(g_usbDevices.size() == 3 && takeDeviceEvent() && g_surfaceArrivals == 3, "plugin's event handling leaves the other user's events alone");
+
+  g_usbSweep.activity();
+  usb_sweep();
+  check(!g_listedContexts.empty()
+        && std::count(g_listedContexts.begin(), g_listedContexts.end(), g_usbCtx) == (int)g_listedContexts.size(),
+        "sweep lists devices on the plugin's context");
+
+  usbStop();
+  check(g_contexts.empty() && g_defaultUsers == 1, "usbStop exits only the plugin's context");
+  plug(&devices[3]);
+  g_libusb.handle_events_timeout(NULL, &tv);
+  check(g_surfaceArrivals == 4, "other user still hears about devices");
+
+  g_libusb.exit(NULL);
+  g_libusb.handle = NULL; // nothing to dlclose
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+// Feeds raw USB configuration descriptors to is_midi_device() and
+// parse_ms_interface(), through a stand-in for libusb_get_config_descriptor()
+// that splits them up the way libusb does. Linux only, like the parser.
+
+#include "../reaper_automidireset.cpp"
+
+#include <memory>
+
+// A configuration descriptor as read from the device (or from sysfs
+// /sys/bus/usb/devices/*/descriptors, after the device descriptor).
+struct DescriptorDump {
+  const char *what;
+  std::vector<unsigned char> bytes;
+  bool midi;
+  midi_port_counts counts;
+};
+
+static const DescriptorDump dumps[] = {
+  {
+    // usbmidi10.pdf appendix B: the example MIDI adapter, 1 in / 1 out
+    "spec example adapter",
+    {
+      0x09, 0x02, 0x65, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, // AudioControl
+      0x09, 0x24, 0x01, 0x00, 0x01, 0x09, 0x00, 0x01, 0x01,
+      0x09, 0x04, 0x01, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00, // MIDIStreaming
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x41, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x01, 0x00, // IN jack, embedded
+      0x06, 0x24, 0x02, 0x02, 0x02, 0x00, // IN jack, external
+      0x09, 0x24, 0x03, 0x01, 0x03, 0x01, 0x02, 0x01, 0x00, // OUT jack, embedded
+      0x09, 0x24, 0x03, 0x02, 0x04, 0x01, 0x01, 0x01, 0x00, // OUT jack, external
+      0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x25, 0x01, 0x01, 0x01,
+      0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x25, 0x01, 0x01, 0x03,
+    },
+    true, { 1, 1 }
+  },
+  {
+    // 2x2 interface, MIDIStreaming only, 64-byte bulk endpoints with two jacks each
+    "2x2 interface",
+    {
+      0x09, 0x02, 0x73, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x61, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x01, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x02, 0x00,
+      0x06, 0x24, 0x02, 0x02, 0x03, 0x00,
+      0x06, 0x24, 0x02, 0x02, 0x04, 0x00,
+      0x09, 0x24, 0x03, 0x01, 0x05, 0x01, 0x03, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x01, 0x06, 0x01, 0x04, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x02, 0x07, 0x01, 0x01, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x02, 0x08, 0x01, 0x02, 0x01, 0x00,
+      0x09, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x06, 0x25, 0x01, 0x02, 0x01, 0x02,
+      0x09, 0x05, 0x82, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x06, 0x25, 0x01, 0x02, 0x05, 0x06,
+    },
+    true, { 2, 2 }
+  },
+  {
+    // keyboard controller without CS_ENDPOINT descriptors: the embedded
+    // jacks are all there is (1 in, 3 out)
+    "no endpoint descriptors",
+    {
+      0x09, 0x02, 0x67, 0x00, 0x01, 0x01, 0x00, 0x80, 0xFA,
+      0x09, 0x04, 0x00, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x55, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x01, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x02, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x03, 0x00,
+      0x06, 0x24, 0x02, 0x02, 0x04, 0x00,
+      0x09, 0x24, 0x03, 0x01, 0x05, 0x01, 0x04, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x02, 0x06, 0x01, 0x01, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x02, 0x07, 0x01, 0x02, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x02, 0x08, 0x01, 0x03, 0x01, 0x00,
+      0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+    },
+    true, { 1, 3 }
+  },
+  {
+    // USB MIDI 2.0 device: altsetting 0 is MIDI 1.0 (1x1), altsetting 1 is
+    // MIDI 2.0 with group terminal blocks, which the drivers don't bind by default
+    "MIDI 2.0 with a 1.0 altsetting",
+    {
+      0x09, 0x02, 0x6C, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x32, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00,
+      0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x25, 0x01, 0x01, 0x01,
+      0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x05, 0x25, 0x01, 0x01, 0x02,
+      0x09, 0x04, 0x00, 0x01, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x02, 0x07, 0x00,
+      0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+      0x05, 0x25, 0x02, 0x01, 0x01,
+      0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+      0x05, 0x25, 0x02, 0x01, 0x01,
+    },
+    true, { 1, 1 }
+  },
+  {
+    // only a MIDI 2.0 altsetting: a MIDI device, but the counts are unknown
+    "MIDI 2.0 only",
+    {
+      0x09, 0x02, 0x31, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x02, 0x07, 0x00,
+      0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+      0x05, 0x25, 0x02, 0x01, 0x01,
+      0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+      0x05, 0x25, 0x02, 0x01, 0x01,
+    },
+    true, { 0, 0 }
+  },
+  {
+    // a CS_ENDPOINT MS_GENERAL cut short at 3 bytes, followed by a vendor
+    // descriptor: its bLength must not be taken for a jack count
+    "short endpoint descriptor",
+    {
+      0x09, 0x02, 0x41, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x2F, 0x00,
+      0x06, 0x24, 0x02, 0x01, 0x01, 0x00,
+      0x09, 0x24, 0x03, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00,
+      0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+      0x03, 0x25, 0x01,
+      0x04, 0xFF, 0x00, 0x00,
+      0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+    },
+    true, { 1, 1 }
+  },
+  {
+    // a jack descriptor claiming more bytes than are left: parsing stops
+    // there, and without an MS header it isn't a MIDI 1.0 altsetting
+    "truncated interface descriptors",
+    {
+      0x09, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00,
+      0x20, 0x24, 0x02, 0x01, 0x01, 0x00,
+      0x07, 0x24, 0x01, 0x00, 0x01, 0x07, 0x00,
+    },
+    true, { 0, 0 }
+  },
+  {
+    // HID keyboard
+    "not MIDI",
+    {
+      0x09, 0x02, 0x22, 0x00, 0x01, 0x01, 0x00, 0xA0, 0x32,
+      0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00,
+      0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3F, 0x00,
+      0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x0A,
+    },
+    false, { 0, 0 }
+  },
+};
+
+// What libusb_get_config_descriptor() makes of a dump: class-specific
+// descriptors following an interface or endpoint become its extra bytes.
+struct ParsedConfig {
+  libusb_config_descriptor config; // first, so that the pointer can be freed
+  std::vector<unsigned char> bytes;
+  std::vector<libusb_interface> interfaces;
+  std::vector<std::vector<libusb_interface_descriptor>> altsettings;
+  std::vector<std::vector<std::vector<libusb_endpoint_descriptor>>> endpoints;
+};
+
+static int fakeGetConfigDescriptor(libusb_device *dev, uint8_t index, libusb_config_descriptor **config)
+{
+  const DescriptorDump &dump = *(const DescriptorDump *)dev;
+  std::unique_ptr<ParsedConfig> parsed(new ParsedConfig());
+  parsed->bytes = dump.bytes; // exactly sized, so overreads show up under ASan
+  const unsigned char *p = parsed->bytes.data();
+  const int len = (int)parsed->bytes.size();
+
+  parsed->config.bLength = p[0];
+  parsed->config.bDescriptorType = p[1];
+  parsed->config.wTotalLength = (uint16_t)(p[2] | (p[3] << 8));
+  parsed->config.bNumInterfaces = p[4];
+
+  const unsigned char **extra = NULL;
+  int *extraLength = NULL;
+  std::vector<int> interfaceNumbers;
+  for (int offset = p[0]; offset + 2 <= len && p[offset] >= 2; offset += p[offset]) {
+    const unsigned char *d = p + offset;
+    if (offset + d[0] > len) {
+      // malformed: hand the rest over as it is, for the parser to reject
+      if (extra) {
+        if (!*extra) *extra = d;
+        *extraLength += len - offset;
+      }
+      break;
+    }
+    if (d[1] == 0x04) {
+      auto it = std::find(interfaceNumbers.begin(), interfaceNumbers.end(), d[2]);
+      size_t i = it - interfaceNumbers.begin();
+      if (it == interfaceNumbers.end()) {
+        interfaceNumbers.push_back(d[2]);
+        parsed->altsettings.emplace_back();
+        parsed->endpoints.emplace_back();
+      }
+      libusb_interface_descriptor alt = {};
+      alt.bLength = d[0];
+      alt.bDescriptorType = d[1];
+      alt.bInterfaceNumber = d[2];
+      alt.bAlternateSetting = d[3];
+      alt.bNumEndpoints = d[4];
+      alt.bInterfaceClass = d[5];
+      alt.bInterfaceSubClass = d[6];
+      alt.bInterfaceProtocol = d[7];
+      parsed->altsettings[i].push_back(alt);
+      parsed->endpoints[i].emplace_back();
+      extra = &parsed->altsettings[i].back().extra;
+      extraLength = &parsed->altsettings[i].back().extra_length;
+    }
+    else if (d[1] == 0x05 && !parsed->endpoints.empty()) {
+      libusb_endpoint_descriptor endpoint = {};
+      endpoint.bLength = d[0];
+      endpoint.bDescriptorType = d[1];
+      endpoint.bEndpointAddress = d[2];
+      endpoint.bmAttributes = d[3];
+      endpoint.wMaxPacketSize = (uint16_t)(d[4] | (d[5] << 8));
+      std::vector<libusb_endpoint_descriptor> &endpoints = parsed->endpoints.back().back();
+      endpoints.push_back(endpoint);
+      extra = &endpoints.back().extra;
+      extraLength = &endpoints.back().extra_length;
+    }
+    else if (extra) {
+      if (!*extra) *extra = d;
+      *extraLength += d[0];
+    }
+  }
+
+  // the vectors are complete, so the pointers between them stay put now
+  for (size_t i = 0; i < parsed->altsettings.size(); ++i) {
+    for (size_t j = 0; j < parsed->altsettings[i].size(); ++j) {
+      parsed->altsettings[i][j].endpoint = parsed->endpoints[i][j].data();
+    }
+    parsed->interfaces.push_back(libusb_interface { parsed->altsettings[i].data(), (int)parsed->altsettings[i].size() });
+  }
+  parsed->config.bNumInterfaces = (uint8_t)parsed->interfaces.size();
+  parsed->config.interface = parsed->interfaces.data();
+  *config = &parsed.release()->config;
+  return LIBUSB_SUCCESS;
+}
+
+static void fakeFreeConfigDescriptor(libusb_config_descriptor *config)
+{
+  delete (ParsedConfig *)config;
+}
+
+int main()
+{
+  g_libusb.get_config_descriptor = fakeGetConfigDescriptor;
+  g_libusb.free_config_descriptor = fakeFreeConfigDescriptor;
+
+  int failures = 0;
+  for (const DescriptorDump &dump : dumps) {
+    libusb_device_descriptor desc = {};
+    desc.bNumConfigurations = 1;
+    midi_port_counts counts = { -1, -1 };
+    bool midi = is_midi_device((libusb_device *)&dump, &desc, &counts);
+    if (midi != dump.midi || counts.inputs != dump.counts.inputs || counts.outputs != dump.counts.outputs) {
+      fprintf(stderr, "FAIL %s: midi %d, %d in, %d out (expected midi %d, %d in, %d out)\n", dump.what,
+              midi, counts.inputs, counts.outputs, dump.midi, dump.counts.inputs, dump.counts.outputs);
+      ++failures;
+    }
+    else {
+      printf("ok   %s\n", dump.what);
+    }
+  }
+  return failures ? 1 : 0;
+}